@@ -3,17 +3,21 @@
 #include <stdlib.h>
 
 #include "coordinator.h"
-
-#define READY 0
-#define NEW_TASK 1
-#define TERMINATE -1
+#include "mpi_scheduler.h"
+#include "numa.h"
+#include "options.h"
+#include "tasks.h"
+#include "trace.h"
 
 int main(int argc, char *argv[])
 {
+  // Pull out `--name=value` options such as --isa=avx2 before the positional arguments
+  parse_options(&argc, argv);
+
   if (argc < 2)
   {
     printf("Error: not enough arguments\n");
-    printf("Usage: %s [path_to_task_list]\n", argv[0]);
+    printf("Usage: %s [--option=value ...] [path_to_task_list]\n", argv[0]);
     return -1;
   }
   int num_tasks;
@@ -21,9 +25,18 @@ int main(int argc, char *argv[])
   if (read_tasks(argv[1], &num_tasks, &tasks))
     return -1;
 
+  // Tasks that share an A matrix are handed out together so A is read once; every rank builds the
+  // same groups from the same list, so only group indices need to be sent
+  int num_groups;
+  task_group_t *groups;
+  if (group_tasks(num_tasks, tasks, &num_groups, &groups))
+    return -1;
+
   // Implement Open MPI coordinator
-  // Use MPI_Init to initialize the program
-  MPI_Init(&argc, &argv);
+  // Use MPI_Init_thread to initialize the program; the manager's dispatcher thread calls MPI while
+  // its main thread computes, which needs at least serialized threading
+  int threading;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &threading);
 
   int procID, totalProcs;
   // Get the total number of processes and store in `totalProcs`
@@ -31,78 +44,32 @@ int main(int argc, char *argv[])
 
   // Get the ID of the current program, and store in `procID`
   MPI_Comm_rank(MPI_COMM_WORLD, &procID);
+  trace_start(procID);
 
-  // check if the current process is the manager
-  if (procID == 0)
+  // Hybrid mode: the ranks sharing a node split its NUMA domains, and each binds its OpenMP workers
+  // to its own domain's CPUs, so outputs are first touched on the domain that computes them. Launch
+  // one rank per domain without MPI binding, e.g. `mpirun --map-by ppr:1:numa --bind-to none`.
+  if (get_option_long("numa", 1))
   {
-    // Manager node
-    int nextTask = 0;
-    MPI_Status status;
-    int32_t message;
-
-    // loop until we've completed `numTasks`
-    while (nextTask < num_tasks)
-    {
-      // receive a message from any source (so we know that this node is done with its task)
-      MPI_Recv(&message, 1, MPI_INT32_T, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
-
-      // get the source process using the `status` struct
-      int sourceProc = status.MPI_SOURCE;
-
-      // send `nextTask` as the message to the process we just received a message from
-      MPI_Send(&nextTask, 1, MPI_INT32_T, sourceProc, 0, MPI_COMM_WORLD);
-
-      // increment `nextTask` by 1
-      nextTask++;
-    }
-
-    // Wait for all processes to finish
-    // loop through all processes
-    // we have `totalProcs - 1` total, since there's a manager node
-    for (int i = 0; i < totalProcs - 1; i++)
-    {
-      // receive a message from any source (so we know that this node is done with its task)
-      MPI_Recv(&message, 1, MPI_INT32_T, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
-
-      // get the source process using the `status` struct
-      int sourceProc = status.MPI_SOURCE;
-
-      // send `TERMINATE` as the message to the process we just received a message from
-      message = TERMINATE;
-      MPI_Send(&message, 1, MPI_INT32_T, sourceProc, 0, MPI_COMM_WORLD);
-    }
+    MPI_Comm node_comm;
+    int local_rank, local_size;
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &local_rank);
+    MPI_Comm_size(node_comm, &local_size);
+    bind_numa(local_rank, local_size);
+    MPI_Comm_free(&node_comm);
   }
-  else
-  {
-    // Worker node
-    int32_t message;
 
-    while (true)
-    {
-      // let the manager node know that this worker is ready
-      // use MPI_Send to send a message
-      message = READY;
-      MPI_Send(&message, 1, MPI_INT32_T, 0, 0, MPI_COMM_WORLD);
+  // A worker whose group failed leaves the manager waiting on its requests, so the job ends here
+  if (schedule_task_groups(MPI_COMM_WORLD, threading, groups, num_groups))
+    MPI_Abort(MPI_COMM_WORLD, -1);
 
-      // receive 1 message from the manager and store it in `message`
-      // use MPI_Recv to receive a message
-      MPI_Recv(&message, 1, MPI_INT32_T, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-      // if the `message` is TERMINATE, break out of the loop to terminate
-      if (message == TERMINATE)
-        break;
-
-      // Add your computation function here and call it to execute the task
-      // The computation function should take the task as an argument and perform the required computations.
-      // Example: execute_task(task);
-      if (execute_task(tasks[message]))
-      {
-        printf("Task %d failed\n", message);
-        return -1;
-      }
-      free(tasks[message]->path);
-    }
-  }
+  for (int i = 0; i < num_tasks; i++)
+    free(tasks[i]->path);
+  free_task_groups(num_groups, groups);
+  free(tasks);
+  trace_stop();
 
   // Finalize MPI
   MPI_Finalize();
@@ -0,0 +1,503 @@
+#include <libgen.h>
+#include <limits.h>
+#include <mpi.h>
+#include <omp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "compute.h"
+#include "kernels.h"
+#include "matrix_cache.h"
+#include "matrix_file.h"
+#include "mpi_scheduler.h"
+#include "options.h"
+#include "tasks.h"
+
+// The reference implementation is naive.c itself, built into this program under other names so it
+// can sit next to the optimized engines
+#define convolve naive_convolve
+#define dot naive_dot
+#define print_m naive_print_m
+#define execute_task naive_execute_task
+#define execute_task_batch naive_execute_task_batch
+#define execute_task_groups naive_execute_task_groups
+#define execute_task_band naive_execute_task_band
+#define convolve_params naive_convolve_params
+#include "naive.c"
+#undef convolve
+#undef dot
+#undef print_m
+#undef execute_task
+#undef execute_task_batch
+#undef execute_task_groups
+#undef execute_task_band
+#undef convolve_params
+
+// Sweeps used when the matching option is not given
+#define DEFAULT_SIZES "256,1024,2048"
+#define DEFAULT_KERNELS "3,7,17,33"
+#define DEFAULT_REPEAT 3
+// Tasks in each coordinator run, and where their directories are written
+#define DEFAULT_COORDINATOR_TASKS 8
+#define DEFAULT_BENCH_DIR "/tmp"
+
+// Most values in one swept list
+#define MAX_SWEEP 32
+
+// Inputs are kept small enough that no sum overflows, so every engine must match naive.c exactly
+#define VALUE_RANGE 16
+
+// Iterations of the loops that measure peak multiply-add throughput
+#define CALIBRATION_ITERATIONS 50000000
+
+static const char *isa_names[ISA_COUNT] = {"scalar", "sse4.1", "avx2", "avx512"};
+
+// Parses a comma-separated list of positive numbers from an option, returning how many were read
+static int parse_sweep(const char *name, const char *default_value, int *values)
+{
+  const char *list = get_option(name);
+  int count = 0;
+
+  if (list == NULL)
+    list = default_value;
+
+  while (*list != '\0' && count < MAX_SWEEP)
+  {
+    char *end;
+    long value = strtol(list, &end, 10);
+
+    if (end == list)
+      break;
+    if (value > 0)
+      values[count++] = value;
+    list = *end == ',' ? end + 1 : end;
+  }
+
+  return count;
+}
+
+// Fills `values` with the powers of two below `limit`, followed by `limit` itself
+static int powers_of_two(int limit, int *values)
+{
+  int count = 0;
+
+  for (int value = 1; value < limit && count < MAX_SWEEP - 1; value *= 2)
+    values[count++] = value;
+  values[count++] = limit;
+  return count;
+}
+
+static matrix_t *random_matrix(int32_t rows, int32_t cols, uint64_t *seed)
+{
+  matrix_t *matrix = malloc(sizeof(matrix_t));
+  matrix->rows = rows;
+  matrix->cols = cols;
+  matrix->data = malloc(sizeof(int32_t) * rows * cols);
+
+  // xorshift64, so every rank generates the same inputs without exchanging them
+  for (int64_t i = 0; i < (int64_t)rows * cols; i++)
+  {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    matrix->data[i] = (int32_t)(*seed % (2 * VALUE_RANGE + 1)) - VALUE_RANGE;
+  }
+
+  return matrix;
+}
+
+static void free_matrix(matrix_t *matrix)
+{
+  free(matrix->data);
+  free(matrix);
+}
+
+static bool same_matrix(matrix_t *a, matrix_t *b)
+{
+  return a->rows == b->rows && a->cols == b->cols &&
+         memcmp(a->data, b->data, sizeof(int32_t) * a->rows * a->cols) == 0;
+}
+
+// Calibration loops: each of four chains adds the product of a counter and a constant to an
+// accumulator, in as many lanes as the instruction set has. The empty asm hides the constant from
+// the compiler, so the multiplies cannot be strength-reduced into additions. Each loop returns the
+// number of multiply-adds it did.
+static int64_t calibrate_scalar(int64_t iterations)
+{
+  int32_t factor = 3, c0 = 0, c1 = 1, c2 = 2, c3 = 3, s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  volatile int32_t sink;
+
+  for (int64_t i = 0; i < iterations; i++)
+  {
+    __asm__ volatile("" : "+r"(factor));
+    s0 += c0++ * factor;
+    s1 += c1++ * factor;
+    s2 += c2++ * factor;
+    s3 += c3++ * factor;
+  }
+  sink = s0 + s1 + s2 + s3;
+  (void)sink;
+
+  return iterations * 4;
+}
+
+#define DEFINE_CALIBRATION(isa, attributes, type, lanes, set1, mullo, add, cvt)                     \
+  attributes static int64_t calibrate_##isa(int64_t iterations)                                 \
+  {                                                                                               \
+    type factor = set1(3), one = set1(1);                                                         \
+    type c0 = set1(0), c1 = set1(1), c2 = set1(2), c3 = set1(3);                                  \
+    type s0 = c0, s1 = c0, s2 = c0, s3 = c0;                                                      \
+    volatile int32_t sink;                                                                        \
+                                                                                                  \
+    for (int64_t i = 0; i < iterations; i++)                                                      \
+    {                                                                                             \
+      __asm__ volatile("" : "+x"(factor));                                                        \
+      s0 = add(s0, mullo(c0, factor));                                                            \
+      s1 = add(s1, mullo(c1, factor));                                                            \
+      s2 = add(s2, mullo(c2, factor));                                                            \
+      s3 = add(s3, mullo(c3, factor));                                                            \
+      c0 = add(c0, one);                                                                          \
+      c1 = add(c1, one);                                                                          \
+      c2 = add(c2, one);                                                                          \
+      c3 = add(c3, one);                                                                          \
+    }                                                                                             \
+    sink = cvt(add(add(s0, s1), add(s2, s3)));                                                    \
+    (void)sink;                                                                                   \
+                                                                                                  \
+    return iterations * 4 * lanes;                                                                \
+  }
+
+DEFINE_CALIBRATION(sse41, __attribute__((target("sse4.1"))), __m128i, 4, _mm_set1_epi32, _mm_mullo_epi32,
+                   _mm_add_epi32, _mm_cvtsi128_si32)
+DEFINE_CALIBRATION(avx2, __attribute__((target("avx2"))), __m256i, 8, _mm256_set1_epi32, _mm256_mullo_epi32,
+                   _mm256_add_epi32, _mm256_cvtsi256_si32)
+DEFINE_CALIBRATION(avx512, __attribute__((target("avx512f"))), __m512i, 16, _mm512_set1_epi32,
+                   _mm512_mullo_epi32, _mm512_add_epi32, _mm512_cvtsi512_si32)
+// Measures the peak multiply-adds per second of one core with the instruction set the kernels use,
+// or takes it from the `peak` option
+static double calibrate_peak()
+{
+  long forced = get_option_long("peak", 0);
+  if (forced > 0)
+    return forced;
+
+  int64_t (*calibrate)(int64_t) = calibrate_scalar;
+  switch (kernel_isa())
+  {
+  case ISA_SSE41:
+    calibrate = calibrate_sse41;
+    break;
+  case ISA_AVX2:
+    calibrate = calibrate_avx2;
+    break;
+  case ISA_AVX512:
+    calibrate = calibrate_avx512;
+    break;
+  default:
+    break;
+  }
+
+  // One short run warms the core up to its sustained clock before the timed one
+  calibrate(CALIBRATION_ITERATIONS / 10);
+  double start = omp_get_wtime();
+  int64_t madds = calibrate(CALIBRATION_ITERATIONS);
+  return madds / (omp_get_wtime() - start);
+}
+
+// Prints one measurement of `tasks` convolutions of a with b as a line of JSON
+static void report(const char *engine, matrix_t *a, matrix_t *b, int tasks, int threads, int ranks, double seconds,
+                   double peak, bool correct)
+{
+  int64_t madds = (int64_t)(a->rows - b->rows + 1) * (a->cols - b->cols + 1) * b->rows * b->cols * tasks;
+  double rate = madds / seconds;
+
+  printf("{\"record\": \"run\", \"engine\": \"%s\", \"rows_a\": %u, \"cols_a\": %u, \"rows_b\": %u, "
+         "\"cols_b\": %u, \"tasks\": %d, \"threads\": %d, \"ranks\": %d, \"seconds\": %.6f, "
+         "\"madds_per_sec\": %.4g, \"peak_fraction\": %.4f, \"correct\": %s}\n",
+         engine, a->rows, a->cols, b->rows, b->cols, tasks, threads, ranks, seconds, rate,
+         rate / (peak * threads * ranks), correct ? "true" : "false");
+  fflush(stdout);
+}
+
+// Writes `num_tasks` tasks convolving a with b under a new directory in the `bench-dir` option, each
+// with its own copy of A so the coordinator schedules them as separate groups, and a task list
+// naming them. Inputs are stored in the mapped format, which lets the coordinator split big groups
+// across ranks. Returns the task list's path in `list`, or -1.
+static int write_tasks(matrix_t *a, matrix_t *b, int num_tasks, char *list)
+{
+  const char *parent = get_option("bench-dir");
+  // Leaves room for the names of the files inside it
+  char root[PATH_MAX - 32];
+
+  if (parent == NULL)
+    parent = DEFAULT_BENCH_DIR;
+  if (snprintf(root, sizeof(root), "%s/convolve-bench-XXXXXX", parent) >= (int)sizeof(root) || mkdtemp(root) == NULL)
+  {
+    fprintf(stderr, "Error: cannot create a task directory in %s\n", parent);
+    return -1;
+  }
+
+  snprintf(list, PATH_MAX, "%s/tasks.txt", root);
+  FILE *file = fopen(list, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Error: cannot write %s\n", list);
+    return -1;
+  }
+  fprintf(file, "%d\n", num_tasks);
+  for (int t = 0; t < num_tasks; t++)
+  {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/task%d", root, t);
+    mkdir(path, 0755);
+    fprintf(file, "%s\n", path);
+  }
+  fclose(file);
+
+  // The task list decides where each task's files live, so the inputs go wherever it says
+  int count;
+  task_t **tasks;
+  if (read_tasks(list, &count, &tasks))
+    return -1;
+
+  int result = 0;
+  for (int t = 0; t < count; t++)
+  {
+    char *a_path = get_a_matrix_path(tasks[t]);
+    char *b_path = get_b_matrix_path(tasks[t]);
+
+    if (result == 0 && (store_mapped_matrix(a_path, a) || store_mapped_matrix(b_path, b)))
+    {
+      fprintf(stderr, "Error: cannot write the inputs of %s\n", tasks[t]->path);
+      result = -1;
+    }
+    free(a_path);
+    free(b_path);
+    free(tasks[t]->path);
+  }
+  free(tasks);
+
+  return result;
+}
+
+// Deletes the task directories and task list written by write_tasks()
+static void remove_tasks(char *list)
+{
+  int count;
+  task_t **tasks;
+
+  if (read_tasks(list, &count, &tasks) == 0)
+  {
+    for (int t = 0; t < count; t++)
+    {
+      char *paths[] = {get_a_matrix_path(tasks[t]), get_b_matrix_path(tasks[t]), get_output_matrix_path(tasks[t])};
+
+      for (int p = 0; p < 3; p++)
+      {
+        unlink(paths[p]);
+        free(paths[p]);
+      }
+      rmdir(tasks[t]->path);
+      free(tasks[t]->path);
+    }
+    free(tasks);
+  }
+
+  unlink(list);
+  rmdir(dirname(list));
+}
+
+// Times one run of the MPI coordinator (schedule_task_groups(), as OpenMPI.c runs it) over the
+// tasks in `list` on the ranks of `comm`, from reading the inputs to writing every output. Rank 0
+// then checks each output against `reference` and clears `correct` on a mismatch.
+static double time_coordinator(MPI_Comm comm, int threading, char *list, matrix_t *reference, bool *correct)
+{
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  int num_tasks, num_groups;
+  task_t **tasks;
+  task_group_t *groups;
+  if (read_tasks(list, &num_tasks, &tasks) || group_tasks(num_tasks, tasks, &num_groups, &groups))
+    MPI_Abort(MPI_COMM_WORLD, -1);
+
+  // Every run reads its inputs again rather than finding them in the matrix cache of the last one,
+  // and starts without the outputs of the last one
+  for (int t = 0; t < num_tasks; t++)
+  {
+    char *a_path = get_a_matrix_path(tasks[t]);
+    char *b_path = get_b_matrix_path(tasks[t]);
+    char *output_path = get_output_matrix_path(tasks[t]);
+
+    forget_cached_matrix(a_path);
+    forget_cached_matrix(b_path);
+    if (rank == 0)
+      unlink(output_path);
+    free(a_path);
+    free(b_path);
+    free(output_path);
+  }
+
+  MPI_Barrier(comm);
+  double start = MPI_Wtime();
+
+  // A failed worker leaves the manager waiting on its requests, as in OpenMPI.c
+  if (schedule_task_groups(comm, threading, groups, num_groups))
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  MPI_Barrier(comm);
+
+  double seconds = MPI_Wtime() - start;
+
+  for (int t = 0; t < num_tasks; t++)
+  {
+    if (rank == 0)
+    {
+      char *output_path = get_output_matrix_path(tasks[t]);
+      matrix_t *output;
+
+      if (load_matrix(output_path, &output) == 0)
+      {
+        *correct = *correct && same_matrix(output, reference);
+        release_matrix(output);
+      }
+      else
+        *correct = false;
+      free(output_path);
+    }
+    free(tasks[t]->path);
+  }
+  free_task_groups(num_groups, groups);
+  free(tasks);
+
+  return seconds;
+}
+
+// Benchmarks naive.c, optimized.c on every thread count and the MPI coordinator on every rank count
+// for each A size and kernel size, checking every result against naive.c. Results are printed as
+// JSON lines on rank 0; the exit status is nonzero if any result was wrong.
+int main(int argc, char *argv[])
+{
+  // The coordinator's dispatcher thread calls MPI while the manager computes, as in OpenMPI.c
+  int threading;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &threading);
+  parse_options(&argc, argv);
+
+  int rank, world;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world);
+
+  int sizes[MAX_SWEEP], kernel_sizes[MAX_SWEEP], thread_counts[MAX_SWEEP], rank_counts[MAX_SWEEP];
+  int num_sizes = parse_sweep("sizes", DEFAULT_SIZES, sizes);
+  int num_kernels = parse_sweep("kernels", DEFAULT_KERNELS, kernel_sizes);
+  int max_threads = omp_get_max_threads();
+  int num_thread_counts = get_option("threads") != NULL ? parse_sweep("threads", "", thread_counts)
+                                                        : powers_of_two(max_threads, thread_counts);
+  int num_rank_counts =
+      get_option("ranks") != NULL ? parse_sweep("ranks", "", rank_counts) : powers_of_two(world, rank_counts);
+  int repeat = get_option_long("repeat", DEFAULT_REPEAT);
+  if (repeat < 1)
+    repeat = 1;
+  int coordinator_tasks = get_option_long("coordinator-tasks", DEFAULT_COORDINATOR_TASKS);
+  if (coordinator_tasks < 1)
+    coordinator_tasks = 1;
+
+  double peak = calibrate_peak();
+  if (rank == 0)
+  {
+    printf("{\"record\": \"machine\", \"isa\": \"%s\", \"max_threads\": %d, \"world_ranks\": %d, "
+           "\"peak_madds_per_sec_per_core\": %.4g}\n",
+           isa_names[kernel_isa()], max_threads, world, peak);
+  }
+
+  bool all_correct = true;
+  for (int s = 0; s < num_sizes; s++)
+  {
+    for (int k = 0; k < num_kernels; k++)
+    {
+      if (kernel_sizes[k] > sizes[s])
+        continue;
+
+      uint64_t seed = 88172645463325252ull + s * MAX_SWEEP + k;
+      matrix_t *a = random_matrix(sizes[s], sizes[s], &seed);
+      matrix_t *b = random_matrix(kernel_sizes[k], kernel_sizes[k], &seed);
+      matrix_t *reference = NULL;
+
+      if (rank == 0)
+      {
+        double start = omp_get_wtime();
+        naive_convolve(a, b, &reference);
+        report("naive", a, b, 1, 1, 1, omp_get_wtime() - start, peak, true);
+
+        for (int t = 0; t < num_thread_counts; t++)
+        {
+          double best = 0;
+          bool correct = true;
+
+          omp_set_num_threads(thread_counts[t]);
+          for (int r = 0; r < repeat; r++)
+          {
+            matrix_t *output;
+
+            start = omp_get_wtime();
+            convolve(a, b, &output);
+            double seconds = omp_get_wtime() - start;
+
+            best = r == 0 || seconds < best ? seconds : best;
+            correct = correct && same_matrix(output, reference);
+            release_matrix(output);
+          }
+          omp_set_num_threads(max_threads);
+
+          report("optimized", a, b, 1, thread_counts[t], 1, best, peak, correct);
+          all_correct = all_correct && correct;
+        }
+      }
+
+      // Rank 0 writes the coordinator's tasks once for every rank count; an empty path means it failed
+      char list[PATH_MAX] = "";
+      if (rank == 0 && write_tasks(a, b, coordinator_tasks, list))
+      {
+        list[0] = '\0';
+        all_correct = false;
+      }
+      MPI_Bcast(list, sizeof(list), MPI_CHAR, 0, MPI_COMM_WORLD);
+
+      // Ranks beyond the count being measured sit the measurement out
+      for (int n = 0; n < num_rank_counts && rank_counts[n] <= world && list[0] != '\0'; n++)
+      {
+        MPI_Comm comm;
+        MPI_Comm_split(MPI_COMM_WORLD, rank < rank_counts[n] ? 0 : MPI_UNDEFINED, rank, &comm);
+        if (comm == MPI_COMM_NULL)
+          continue;
+
+        double best = 0;
+        bool correct = true;
+        for (int r = 0; r < repeat; r++)
+        {
+          double seconds = time_coordinator(comm, threading, list, reference, &correct);
+          best = r == 0 || seconds < best ? seconds : best;
+        }
+
+        if (rank == 0)
+        {
+          report("mpi-coordinator", a, b, coordinator_tasks, max_threads, rank_counts[n], best, peak, correct);
+          all_correct = all_correct && correct;
+        }
+        MPI_Comm_free(&comm);
+      }
+
+      if (rank == 0 && list[0] != '\0')
+        remove_tasks(list);
+
+      if (reference != NULL)
+        free_matrix(reference);
+      free_matrix(a);
+      free_matrix(b);
+    }
+  }
+
+  MPI_Finalize();
+  return all_correct ? 0 : 1;
+}
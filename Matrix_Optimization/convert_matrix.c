@@ -0,0 +1,36 @@
+#include "compute.h"
+#include "matrix_file.h"
+#include "options.h"
+
+// Converts a matrix file between the legacy format and the mapped format. By default the output is
+// written in the other format from the input; --to=mapped or --to=legacy picks one explicitly.
+int main(int argc, char *argv[])
+{
+  parse_options(&argc, argv);
+
+  if (argc < 3)
+  {
+    printf("Error: not enough arguments\n");
+    printf("Usage: %s [--to=mapped|legacy] [input_matrix] [output_matrix]\n", argv[0]);
+    return -1;
+  }
+
+  const char *to = get_option("to");
+  bool mapped = to != NULL ? strcmp(to, "mapped") == 0 : !is_mapped_matrix(argv[1]);
+
+  matrix_t *matrix;
+  if (load_matrix(argv[1], &matrix))
+  {
+    printf("Error: could not read %s\n", argv[1]);
+    return -1;
+  }
+
+  if (mapped ? store_mapped_matrix(argv[2], matrix) : write_matrix(argv[2], matrix))
+  {
+    printf("Error: could not write %s\n", argv[2]);
+    return -1;
+  }
+
+  release_matrix(matrix);
+  return 0;
+}
@@ -1,14 +1,21 @@
 #include "coordinator.h"
+#include "options.h"
+#include "tasks.h"
+#include "trace.h"
 
 int main(int argc, char *argv[])
 {
+  // Pull out `--name=value` options such as --isa=avx2 before the positional arguments
+  parse_options(&argc, argv);
+
   if (argc < 2)
   {
     printf("Error: not enough arguments\n");
-    printf("Usage: %s [path_to_task_list]\n", argv[0]);
+    printf("Usage: %s [--option=value ...] [path_to_task_list]\n", argv[0]);
 
     return -1;
   }
+  trace_start(0);
 
   // Read and parse task list file
   int num_tasks;
@@ -16,15 +23,28 @@ int main(int argc, char *argv[])
   if (read_tasks(argv[1], &num_tasks, &tasks))
     return -1;
 
-  // Execute tasks
-  for (int i = 0; i < num_tasks; i++)
+  // Tasks that share an A matrix are executed together so A is read once
+  int num_groups;
+  task_group_t *groups;
+  if (group_tasks(num_tasks, tasks, &num_groups, &groups))
+    return -1;
+
+  // Execute tasks, overlapping each group's computation with the I/O of its neighbours
+  task_group_t **order = malloc(sizeof(task_group_t *) * (num_groups > 0 ? num_groups : 1));
+  for (int i = 0; i < num_groups; i++)
+    order[i] = &groups[i];
+
+  task_t *failed;
+  if (execute_task_groups(order, num_groups, &failed))
   {
-    if (execute_task(tasks[i]))
-    {
-      printf("Task %d failed\n", i);
-      return -1;
-    }
-    free(tasks[i]->path);
+    printf("Task %s failed\n", failed->path);
+    return -1;
   }
+  free(order);
+
+  for (int i = 0; i < num_tasks; i++)
+    free(tasks[i]->path);
+  free_task_groups(num_groups, groups);
   free(tasks);
+  trace_stop();
 }
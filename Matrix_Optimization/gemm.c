@@ -0,0 +1,235 @@
+#include <omp.h>
+#include <x86intrin.h>
+
+#include "compute.h"
+#include "kernels.h"
+
+// Lowers the convolution to a matrix multiply. For A row t and a strip of output columns j, the
+// im2col panel P[c][m] = A[t][j + m + c] is multiplied by the flipped kernel (rows_b x cols_b) to
+// give the contribution Y[k][m] of A row t to output row t - k. Each panel load is reused for
+// GEMM_NR kernel rows held in registers, and the panel and kernel blocks are sized to stay in L1
+// while the output block they accumulate into stays in L2.
+
+// Kernel rows per microkernel call (the N side of the register tile)
+#define GEMM_NR 4
+// Kernel columns per L1 block (the K dimension of the multiply)
+#define GEMM_KC 128
+// Output rows and columns per L2 block; blocks are also the unit of parallel work
+#define GEMM_MC 64
+#define GEMM_NC 256
+// Widest panel strip (two AVX-512 vectors)
+#define GEMM_MAX_MR 32
+
+typedef struct
+{
+  const conv_args_t *args;
+  // flipped_b regrouped so the GEMM_NR coefficients of one column are adjacent:
+  // packed_b[(k / GEMM_NR) * cols_b + c][k % GEMM_NR], zero padded to a multiple of GEMM_NR rows
+  int32_t *packed_b;
+} gemm_t;
+
+// Packs and multiplies the panel for A row t and output columns [j, j + width), adding the
+// results into the output rows of [row_begin, row_end) that A row t contributes to
+typedef void (*strip_fn)(const gemm_t *gemm, int32_t *panel, int32_t t, int32_t j, int32_t width, int32_t c0,
+                         int32_t kc, int32_t row_begin, int32_t row_end);
+
+// Returns the range of kernel rows k for which output row t - k lies in [row_begin, row_end)
+static inline void kernel_rows(const conv_args_t *args, int32_t t, int32_t row_begin, int32_t row_end,
+                               int32_t *k_lo, int32_t *k_hi)
+{
+  *k_lo = t - (row_end - 1) > 0 ? t - (row_end - 1) : 0;
+  *k_hi = t - row_begin < args->rows_b - 1 ? t - row_begin : args->rows_b - 1;
+}
+
+__attribute__((target("avx2"))) static void strip_avx2(const gemm_t *gemm, int32_t *panel, int32_t t, int32_t j,
+                                                         int32_t width, int32_t c0, int32_t kc,
+                                                         int32_t row_begin, int32_t row_end)
+{
+  const conv_args_t *args = gemm->args;
+  __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(width), lane_index);
+  __m256i mask2 = _mm256_cmpgt_epi32(_mm256_set1_epi32(width - 8), lane_index);
+  int32_t *a_index = &args->a[(size_t)t * args->cols_a + j + c0];
+
+  // Pack the im2col panel; lanes past the last output column are zeroed
+  for (int32_t c = 0; c < kc; c++, a_index++)
+  {
+    _mm256_store_si256((__m256i *)(panel + c * 16), _mm256_maskload_epi32(a_index, mask));
+    _mm256_store_si256((__m256i *)(panel + c * 16 + 8), _mm256_maskload_epi32(a_index + 8, mask2));
+  }
+
+  int32_t k_lo, k_hi;
+  kernel_rows(args, t, row_begin, row_end, &k_lo, &k_hi);
+
+  for (int32_t kb = k_lo - k_lo % GEMM_NR; kb <= k_hi; kb += GEMM_NR)
+  {
+    __m256i acc[GEMM_NR][2];
+    int32_t *b_index = &gemm->packed_b[((size_t)(kb / GEMM_NR) * args->cols_b + c0) * GEMM_NR];
+
+    for (int32_t r = 0; r < GEMM_NR; r++)
+    {
+      acc[r][0] = _mm256_setzero_si256();
+      acc[r][1] = _mm256_setzero_si256();
+    }
+
+    for (int32_t c = 0; c < kc; c++, b_index += GEMM_NR)
+    {
+      __m256i p0 = _mm256_load_si256((__m256i *)(panel + c * 16));
+      __m256i p1 = _mm256_load_si256((__m256i *)(panel + c * 16 + 8));
+
+      for (int32_t r = 0; r < GEMM_NR; r++)
+      {
+        __m256i coef = _mm256_set1_epi32(b_index[r]);
+        acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_mullo_epi32(p0, coef));
+        acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_mullo_epi32(p1, coef));
+      }
+    }
+
+    for (int32_t r = 0; r < GEMM_NR; r++)
+    {
+      int32_t k = kb + r;
+      if (k < k_lo || k > k_hi)
+        continue;
+
+      int32_t *output_index = &args->output[(size_t)(t - k) * args->cols_output + j];
+      _mm256_maskstore_epi32(output_index, mask,
+                             _mm256_add_epi32(_mm256_maskload_epi32(output_index, mask), acc[r][0]));
+      _mm256_maskstore_epi32(output_index + 8, mask2,
+                             _mm256_add_epi32(_mm256_maskload_epi32(output_index + 8, mask2), acc[r][1]));
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) static void strip_avx512(const gemm_t *gemm, int32_t *panel, int32_t t, int32_t j,
+                                                             int32_t width, int32_t c0, int32_t kc,
+                                                             int32_t row_begin, int32_t row_end)
+{
+  const conv_args_t *args = gemm->args;
+  __mmask16 mask = width >= 16 ? 0xFFFF : (__mmask16)((1u << width) - 1);
+  __mmask16 mask2 = width >= 32 ? 0xFFFF : width <= 16 ? 0 : (__mmask16)((1u << (width - 16)) - 1);
+  int32_t *a_index = &args->a[(size_t)t * args->cols_a + j + c0];
+
+  // Pack the im2col panel; lanes past the last output column are zeroed
+  for (int32_t c = 0; c < kc; c++, a_index++)
+  {
+    _mm512_store_si512(panel + c * 32, _mm512_maskz_loadu_epi32(mask, a_index));
+    _mm512_store_si512(panel + c * 32 + 16, _mm512_maskz_loadu_epi32(mask2, a_index + 16));
+  }
+
+  int32_t k_lo, k_hi;
+  kernel_rows(args, t, row_begin, row_end, &k_lo, &k_hi);
+
+  for (int32_t kb = k_lo - k_lo % GEMM_NR; kb <= k_hi; kb += GEMM_NR)
+  {
+    __m512i acc[GEMM_NR][2];
+    int32_t *b_index = &gemm->packed_b[((size_t)(kb / GEMM_NR) * args->cols_b + c0) * GEMM_NR];
+
+    for (int32_t r = 0; r < GEMM_NR; r++)
+    {
+      acc[r][0] = _mm512_setzero_si512();
+      acc[r][1] = _mm512_setzero_si512();
+    }
+
+    for (int32_t c = 0; c < kc; c++, b_index += GEMM_NR)
+    {
+      __m512i p0 = _mm512_load_si512(panel + c * 32);
+      __m512i p1 = _mm512_load_si512(panel + c * 32 + 16);
+
+      for (int32_t r = 0; r < GEMM_NR; r++)
+      {
+        __m512i coef = _mm512_set1_epi32(b_index[r]);
+        acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_mullo_epi32(p0, coef));
+        acc[r][1] = _mm512_add_epi32(acc[r][1], _mm512_mullo_epi32(p1, coef));
+      }
+    }
+
+    for (int32_t r = 0; r < GEMM_NR; r++)
+    {
+      int32_t k = kb + r;
+      if (k < k_lo || k > k_hi)
+        continue;
+
+      int32_t *output_index = &args->output[(size_t)(t - k) * args->cols_output + j];
+      _mm512_mask_storeu_epi32(output_index, mask,
+                               _mm512_add_epi32(_mm512_maskz_loadu_epi32(mask, output_index), acc[r][0]));
+      _mm512_mask_storeu_epi32(output_index + 16, mask2,
+                               _mm512_add_epi32(_mm512_maskz_loadu_epi32(mask2, output_index + 16), acc[r][1]));
+    }
+  }
+}
+
+int32_t *gemm_pack_kernel(const int32_t *flipped_b, int32_t rows_b, int32_t cols_b)
+{
+  int32_t k_blocks = (rows_b + GEMM_NR - 1) / GEMM_NR;
+  int32_t *packed_b = calloc((size_t)k_blocks * cols_b * GEMM_NR, sizeof(int32_t));
+
+  // Regroup flipped_b into GEMM_NR-row groups
+  for (int32_t k = 0; k < rows_b; k++)
+  {
+    for (int32_t c = 0; c < cols_b; c++)
+    {
+      packed_b[((size_t)(k / GEMM_NR) * cols_b + c) * GEMM_NR + k % GEMM_NR] = flipped_b[k * cols_b + c];
+    }
+  }
+
+  return packed_b;
+}
+
+size_t gemm_scratch_size(const conv_args_t *args)
+{
+  size_t packed_size = (size_t)(args->rows_b + GEMM_NR - 1) / GEMM_NR * args->cols_b * GEMM_NR;
+
+  // The packed kernel, and one panel per thread
+  return sizeof(int32_t) * (packed_size + (size_t)omp_get_max_threads() * GEMM_KC * GEMM_MAX_MR);
+}
+
+void gemm_convolve(const conv_args_t *args, int32_t *packed_b, isa_t isa)
+{
+  int32_t rows_b = args->rows_b;
+  int32_t cols_b = args->cols_b;
+  strip_fn strip = isa >= ISA_AVX512 ? strip_avx512 : strip_avx2;
+  int32_t mr = isa >= ISA_AVX512 ? 32 : 16;
+  gemm_t gemm = {args, packed_b};
+
+  int32_t bands = (args->rows_output + GEMM_MC - 1) / GEMM_MC;
+  int32_t blocks = (args->cols_output + GEMM_NC - 1) / GEMM_NC;
+
+#pragma omp parallel
+  {
+    int32_t *panel = aligned_alloc(64, sizeof(int32_t) * GEMM_KC * GEMM_MAX_MR);
+
+#pragma omp for collapse(2) schedule(dynamic)
+    for (int32_t band = 0; band < bands; band++)
+    {
+      for (int32_t block = 0; block < blocks; block++)
+      {
+        int32_t row_begin = band * GEMM_MC;
+        int32_t row_end = row_begin + GEMM_MC < args->rows_output ? row_begin + GEMM_MC : args->rows_output;
+        int32_t col_begin = block * GEMM_NC;
+        int32_t col_end = col_begin + GEMM_NC < args->cols_output ? col_begin + GEMM_NC : args->cols_output;
+
+        for (int32_t i = row_begin; i < row_end; i++)
+        {
+          memset(&args->output[(size_t)i * args->cols_output + col_begin], 0,
+                 sizeof(int32_t) * (col_end - col_begin));
+        }
+
+        for (int32_t c0 = 0; c0 < cols_b; c0 += GEMM_KC)
+        {
+          int32_t kc = cols_b - c0 < GEMM_KC ? cols_b - c0 : GEMM_KC;
+
+          // Every A row that feeds this band contributes through one or more kernel rows
+          for (int32_t t = row_begin; t < row_end + rows_b - 1; t++)
+          {
+            for (int32_t j = col_begin; j < col_end; j += mr)
+            {
+              strip(&gemm, panel, t, j, col_end - j < mr ? col_end - j : mr, c0, kc, row_begin, row_end);
+            }
+          }
+        }
+      }
+    }
+
+    free(panel);
+  }
+}
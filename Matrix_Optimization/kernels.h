@@ -0,0 +1,92 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Instruction set variants, ordered from least to most capable
+typedef enum
+{
+  ISA_SCALAR,
+  ISA_SSE41,
+  ISA_AVX2,
+  ISA_AVX512,
+  ISA_COUNT
+} isa_t;
+
+// Operands of one convolution, shared by every kernel variant and engine
+typedef struct
+{
+  int32_t *a;
+  int32_t cols_a;
+  int32_t *flipped_b;
+  int32_t rows_b;
+  int32_t cols_b;
+  int32_t *output;
+  int32_t rows_output;
+  int32_t cols_output;
+} conv_args_t;
+
+// Returns the instruction set chosen for this process (see the `isa` option)
+isa_t kernel_isa();
+
+// Computes output rows [row_begin, row_end) and columns [col_begin, col_end) with the direct
+// microkernel of the selected instruction set (optimized.c)
+void convolve_region(const conv_args_t *args, int32_t row_begin, int32_t row_end, int32_t col_begin,
+                     int32_t col_end);
+
+// The *_scratch_size() functions return the bytes an engine allocates for args beyond A, the output
+// and the caller's plan, with every OpenMP thread working, so callers on a memory budget can size
+// their inputs to leave room for it.
+
+// im2col + cache-blocked GEMM engine, available for AVX2 and up (gemm.c). gemm_pack_kernel()
+// returns the kernel in the layout gemm_convolve() reads, to be freed by the caller;
+// gemm_scratch_size() counts that packed kernel as well.
+int32_t *gemm_pack_kernel(const int32_t *flipped_b, int32_t rows_b, int32_t cols_b);
+void gemm_convolve(const conv_args_t *args, int32_t *packed_b, isa_t isa);
+size_t gemm_scratch_size(const conv_args_t *args);
+
+// Exact NTT-based engine for very large kernels (ntt.c)
+bool ntt_supported(int32_t rows_a, int32_t cols_a, int32_t rows_b, int32_t cols_b);
+void ntt_convolve(const conv_args_t *args);
+size_t ntt_scratch_size(const conv_args_t *args);
+
+// 16-bit path for inputs whose values all fit in int16_t, available for AVX2 and up (narrow.c).
+// narrow_pack_kernel() returns flipped_b with adjacent columns packed in pairs, to be freed by the
+// caller, or NULL if a coefficient does not fit. narrow_pair_rows() packs each element of a rows x
+// cols window of A, whose rows are `stride` apart, with its right neighbour in the window into
+// `pairs` (rows x cols), and returns false if a value does not fit. narrow_region() is
+// convolve_region() for args whose a is such pairs and whose flipped_b is the packed kernel.
+int32_t *narrow_pack_kernel(const int32_t *flipped_b, int32_t rows_b, int32_t cols_b);
+bool narrow_pair_rows(const int32_t *a, int32_t rows, int32_t cols, int32_t stride, int32_t *pairs);
+void narrow_region(const conv_args_t *args, int32_t row_begin, int32_t row_end, int32_t col_begin, int32_t col_end);
+
+// A nonzero coefficient of a flipped kernel and its position
+typedef struct
+{
+  int32_t row;
+  int32_t col;
+  int32_t value;
+} sparse_entry_t;
+
+// Engine for kernels that are mostly zeros (sparse.c). sparse_pack_kernel() lists the nonzero
+// coefficients of flipped_b in `entries`, to be freed by the caller, and returns how many there are.
+int32_t sparse_pack_kernel(const int32_t *flipped_b, int32_t rows_b, int32_t cols_b, sparse_entry_t **entries);
+void sparse_convolve(const conv_args_t *args, const sparse_entry_t *entries, int32_t num_entries, isa_t isa);
+
+// Strided and dilated form of sparse_convolve(), which computes only the outputs a stride keeps:
+// output (i, j) is the sum of each entry's value times a[i * stride_rows + row][j * stride_cols +
+// col], so entries hold the positions of the dilated kernel. Several kernels can be applied in one
+// call, sharing every row of A they read: the num_entries[m] entries of kernel m follow those of
+// kernel m - 1, and its output is the rows_output x cols_output matrix at output + m *
+// rows_output * cols_output. Only a, cols_a, output, rows_output and cols_output of args are read.
+void sparse_convolve_strided(const conv_args_t *args, const sparse_entry_t *entries, const int32_t *num_entries,
+                             int32_t num_kernels, int32_t stride_rows, int32_t stride_cols, isa_t isa);
+
+// Two-pass engine for rank-1 kernels (separable.c). separable_factor() splits a rows x cols kernel
+// into exact integer factors with kernel[i][j] == column[i] * row[j], or returns false.
+bool separable_factor(const int32_t *kernel, int32_t rows, int32_t cols, int32_t *column, int32_t *row);
+void separable_convolve(const conv_args_t *args, int32_t *column, int32_t *row);
+size_t separable_scratch_size(const conv_args_t *args);
+
+#endif
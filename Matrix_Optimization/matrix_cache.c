@@ -0,0 +1,197 @@
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "compute.h"
+#include "matrix_cache.h"
+#include "matrix_file.h"
+#include "options.h"
+
+#define DEFAULT_MATRIX_CACHE (256L << 20)
+
+typedef struct cached_matrix
+{
+  char *path;
+  struct timespec mtime;
+  off_t size;
+  // Owned by the cache; callers get their own matrix_t pointing at the same data
+  matrix_t *matrix;
+  size_t bytes;
+  int users;
+  // Set once the file has changed or been forgotten; the entry goes away when its last user does
+  bool stale;
+  struct cached_matrix *next;
+} cached_matrix_t;
+
+// Most recently used first
+static cached_matrix_t *entries;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long cache_capacity()
+{
+  return get_option_long("matrix-cache", DEFAULT_MATRIX_CACHE);
+}
+
+static matrix_t *new_handle(matrix_t *matrix)
+{
+  matrix_t *handle = malloc(sizeof(matrix_t));
+
+  *handle = *matrix;
+  return handle;
+}
+
+static void free_entry(cached_matrix_t *entry)
+{
+  release_matrix(entry->matrix);
+  free(entry->path);
+  free(entry);
+}
+
+// Unlinks unused entries that are stale or beyond the capacity, least recently used first. Called
+// with the lock held; the unlinked entries are returned so they are freed outside of it.
+static cached_matrix_t *evict(size_t capacity)
+{
+  cached_matrix_t *evicted = NULL;
+  cached_matrix_t **link = &entries;
+  size_t kept = 0;
+
+  // Entries in use always stay, so the unused ones fill what is left of the capacity in LRU order
+  for (cached_matrix_t *entry = entries; entry != NULL; entry = entry->next)
+  {
+    if (entry->users > 0)
+      kept += entry->bytes;
+  }
+
+  while (*link != NULL)
+  {
+    cached_matrix_t *entry = *link;
+
+    if (entry->users == 0 && (entry->stale || kept + entry->bytes > capacity))
+    {
+      *link = entry->next;
+      entry->next = evicted;
+      evicted = entry;
+      continue;
+    }
+
+    if (entry->users == 0)
+      kept += entry->bytes;
+    link = &entry->next;
+  }
+
+  return evicted;
+}
+
+static void free_entries(cached_matrix_t *entry)
+{
+  while (entry != NULL)
+  {
+    cached_matrix_t *next = entry->next;
+
+    free_entry(entry);
+    entry = next;
+  }
+}
+
+int load_cached_matrix(char *path, matrix_t **matrix)
+{
+  long capacity = cache_capacity();
+  struct stat st;
+
+  if (capacity <= 0 || stat(path, &st))
+    return load_matrix(path, matrix);
+
+  pthread_mutex_lock(&cache_lock);
+  for (cached_matrix_t **link = &entries; *link != NULL; link = &(*link)->next)
+  {
+    cached_matrix_t *entry = *link;
+
+    if (entry->stale || strcmp(entry->path, path) != 0)
+      continue;
+
+    if (entry->size != st.st_size || entry->mtime.tv_sec != st.st_mtim.tv_sec ||
+        entry->mtime.tv_nsec != st.st_mtim.tv_nsec)
+    {
+      entry->stale = true;
+      continue;
+    }
+
+    // Move to the front
+    *link = entry->next;
+    entry->next = entries;
+    entries = entry;
+    entry->users++;
+    *matrix = new_handle(entry->matrix);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  matrix_t *loaded;
+  if (load_matrix(path, &loaded))
+    return -1;
+
+  size_t bytes = sizeof(int32_t) * (size_t)loaded->rows * loaded->cols;
+  if (bytes > (size_t)capacity)
+  {
+    *matrix = loaded;
+    return 0;
+  }
+
+  cached_matrix_t *entry = malloc(sizeof(cached_matrix_t));
+  entry->path = strdup(path);
+  entry->mtime = st.st_mtim;
+  entry->size = st.st_size;
+  entry->matrix = loaded;
+  entry->bytes = bytes;
+  entry->users = 1;
+  entry->stale = false;
+  *matrix = new_handle(loaded);
+
+  pthread_mutex_lock(&cache_lock);
+  entry->next = entries;
+  entries = entry;
+  cached_matrix_t *evicted = evict(capacity);
+  pthread_mutex_unlock(&cache_lock);
+
+  free_entries(evicted);
+  return 0;
+}
+
+bool release_cached_matrix(matrix_t *matrix)
+{
+  cached_matrix_t *entry;
+
+  pthread_mutex_lock(&cache_lock);
+  for (entry = entries; entry != NULL && entry->matrix->data != matrix->data; entry = entry->next)
+    ;
+
+  // The cache's own matrix is released by free_entry() after it has been unlinked, so it is never
+  // mistaken for a handle here
+  if (entry == NULL)
+  {
+    pthread_mutex_unlock(&cache_lock);
+    return false;
+  }
+
+  entry->users--;
+  cached_matrix_t *evicted = evict(cache_capacity());
+  pthread_mutex_unlock(&cache_lock);
+
+  free(matrix);
+  free_entries(evicted);
+  return true;
+}
+
+void forget_cached_matrix(char *path)
+{
+  pthread_mutex_lock(&cache_lock);
+  for (cached_matrix_t *entry = entries; entry != NULL; entry = entry->next)
+  {
+    if (strcmp(entry->path, path) == 0)
+      entry->stale = true;
+  }
+  cached_matrix_t *evicted = evict(cache_capacity());
+  pthread_mutex_unlock(&cache_lock);
+
+  free_entries(evicted);
+}
@@ -0,0 +1,23 @@
+#ifndef MATRIX_CACHE_H
+#define MATRIX_CACHE_H
+
+#include <stdbool.h>
+
+#include "compute.h"
+
+// Keeps recently loaded input matrices in memory so tasks that reuse a file skip the read. Entries
+// are keyed by path, modification time and size, so a file rewritten between tasks is read again.
+// The cache holds at most `matrix-cache` bytes (default 256M, 0 disables it) of matrices that no
+// task is using, evicting the least recently used first.
+
+// Loads a matrix like load_matrix(), serving it from the cache when possible. The matrix is
+// shared and must not be written; release it with release_matrix().
+int load_cached_matrix(char *path, matrix_t **matrix);
+
+// Drops a reference taken by load_cached_matrix(); returns false if matrix did not come from it
+bool release_cached_matrix(matrix_t *matrix);
+
+// Drops the cached copy of path, if any, before the file is rewritten
+void forget_cached_matrix(char *path);
+
+#endif
@@ -0,0 +1,274 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compute.h"
+#include "matrix_cache.h"
+#include "matrix_file.h"
+#include "matrix_pool.h"
+
+// Mappings currently backing a matrix_t, looked up by their data pointer on release
+typedef struct mapping
+{
+  int32_t *data;
+  void *base;
+  size_t length;
+  struct mapping *next;
+} mapping_t;
+
+static mapping_t *mappings;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_mapping(int32_t *data, void *base, size_t length)
+{
+  mapping_t *mapping = malloc(sizeof(mapping_t));
+  mapping->data = data;
+  mapping->base = base;
+  mapping->length = length;
+
+  pthread_mutex_lock(&mappings_lock);
+  mapping->next = mappings;
+  mappings = mapping;
+  pthread_mutex_unlock(&mappings_lock);
+}
+
+// Removes and returns the mapping behind data, or NULL if data was not mapped
+static mapping_t *take_mapping(int32_t *data)
+{
+  pthread_mutex_lock(&mappings_lock);
+
+  mapping_t **link = &mappings;
+  while (*link != NULL && (*link)->data != data)
+    link = &(*link)->next;
+
+  mapping_t *mapping = *link;
+  if (mapping != NULL)
+    *link = mapping->next;
+
+  pthread_mutex_unlock(&mappings_lock);
+  return mapping;
+}
+
+static size_t payload_offset()
+{
+  return (sizeof(matrix_header_t) + MATRIX_FILE_ALIGNMENT - 1) / MATRIX_FILE_ALIGNMENT * MATRIX_FILE_ALIGNMENT;
+}
+
+// Fills in the header of a new mapped matrix file
+static void init_header(matrix_header_t *header, uint32_t rows, uint32_t cols)
+{
+  memset(header, 0, sizeof(*header));
+  header->magic = MATRIX_FILE_MAGIC;
+  header->version = MATRIX_FILE_VERSION;
+  header->rows = rows;
+  header->cols = cols;
+  header->element_size = sizeof(int32_t);
+  header->data_offset = payload_offset();
+}
+
+// Reads and checks the header of an open file; returns false for anything not in the mapped format
+static bool read_header(int fd, matrix_header_t *header)
+{
+  struct stat st;
+
+  if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) || header->magic != MATRIX_FILE_MAGIC)
+    return false;
+  if (header->version != MATRIX_FILE_VERSION || header->element_size != sizeof(int32_t) ||
+      header->data_offset % MATRIX_FILE_ALIGNMENT != 0)
+    return false;
+
+  // A legacy file whose first word happens to match the magic will not also have a matching size
+  return fstat(fd, &st) == 0 &&
+         (uint64_t)st.st_size >= header->data_offset + (uint64_t)header->rows * header->cols * sizeof(int32_t);
+}
+
+bool is_mapped_matrix(char *path)
+{
+  matrix_header_t header;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return false;
+
+  bool mapped = read_header(fd, &header);
+  close(fd);
+  return mapped;
+}
+
+int load_matrix(char *path, matrix_t **matrix)
+{
+  matrix_header_t header;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return -1;
+
+  if (!read_header(fd, &header))
+  {
+    close(fd);
+    return read_matrix(path, matrix);
+  }
+
+  size_t length = header.data_offset + (size_t)header.rows * header.cols * sizeof(int32_t);
+  void *base = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED)
+    return -1;
+
+  *matrix = malloc(sizeof(matrix_t));
+  (*matrix)->rows = header.rows;
+  (*matrix)->cols = header.cols;
+  (*matrix)->data = (int32_t *)((char *)base + header.data_offset);
+
+  add_mapping((*matrix)->data, base, length);
+  return 0;
+}
+
+int create_mapped_matrix(char *path, uint32_t rows, uint32_t cols, matrix_t **matrix)
+{
+  size_t offset = payload_offset();
+  size_t length = offset + (size_t)rows * cols * sizeof(int32_t);
+
+  forget_cached_matrix(path);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0)
+    return -1;
+
+  if (ftruncate(fd, length))
+  {
+    close(fd);
+    return -1;
+  }
+
+  void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED)
+    return -1;
+
+  init_header(base, rows, cols);
+
+  *matrix = malloc(sizeof(matrix_t));
+  (*matrix)->rows = rows;
+  (*matrix)->cols = cols;
+  (*matrix)->data = (int32_t *)((char *)base + offset);
+
+  add_mapping((*matrix)->data, base, length);
+  return 0;
+}
+
+int store_mapped_matrix(char *path, matrix_t *matrix)
+{
+  matrix_t *file_matrix;
+
+  if (create_mapped_matrix(path, matrix->rows, matrix->cols, &file_matrix))
+    return -1;
+
+  memcpy(file_matrix->data, matrix->data, sizeof(int32_t) * matrix->rows * matrix->cols);
+  release_matrix(file_matrix);
+  return 0;
+}
+
+int open_matrix_stream(char *path, matrix_header_t *header)
+{
+  int fd = open(path, O_RDONLY);
+
+  if (fd >= 0 && !read_header(fd, header))
+  {
+    close(fd);
+    return -1;
+  }
+
+  // Streams are read front to back once
+  if (fd >= 0)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  return fd;
+}
+
+// Opens an output stream of the given size with the given extra open() flags
+static int open_output_stream(char *path, uint32_t rows, uint32_t cols, matrix_header_t *header, int flags)
+{
+  forget_cached_matrix(path);
+  int fd = open(path, O_RDWR | O_CREAT | flags, 0644);
+
+  if (fd < 0)
+    return -1;
+
+  init_header(header, rows, cols);
+  if (pwrite(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+      ftruncate(fd, header->data_offset + (uint64_t)rows * cols * sizeof(int32_t)))
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int create_matrix_stream(char *path, uint32_t rows, uint32_t cols, matrix_header_t *header)
+{
+  return open_output_stream(path, rows, cols, header, O_TRUNC);
+}
+
+int share_matrix_stream(char *path, uint32_t rows, uint32_t cols, matrix_header_t *header)
+{
+  // Every opener writes the same header and sets the same length, so the order they run in does not
+  // matter and rows already written by another process survive
+  return open_output_stream(path, rows, cols, header, 0);
+}
+
+// Moves `length` bytes between a buffer and a file offset, retrying short transfers
+static int transfer(int fd, void *buffer, size_t length, off_t offset, bool write)
+{
+  while (length > 0)
+  {
+    ssize_t done = write ? pwrite(fd, buffer, length, offset) : pread(fd, buffer, length, offset);
+
+    if (done <= 0)
+      return -1;
+
+    buffer = (char *)buffer + done;
+    length -= done;
+    offset += done;
+  }
+
+  return 0;
+}
+
+int read_matrix_rows(int fd, const matrix_header_t *header, uint32_t row_begin, uint32_t rows, int32_t *buffer)
+{
+  return transfer(fd, buffer, (size_t)rows * header->cols * sizeof(int32_t),
+                  header->data_offset + (off_t)row_begin * header->cols * sizeof(int32_t), false);
+}
+
+int write_matrix_rows(int fd, const matrix_header_t *header, uint32_t row_begin, uint32_t rows,
+                      const int32_t *buffer)
+{
+  return transfer(fd, (void *)buffer, (size_t)rows * header->cols * sizeof(int32_t),
+                  header->data_offset + (off_t)row_begin * header->cols * sizeof(int32_t), true);
+}
+
+void release_matrix(matrix_t *matrix)
+{
+  if (release_cached_matrix(matrix))
+    return;
+
+  mapping_t *mapping = take_mapping(matrix->data);
+
+  if (mapping != NULL)
+  {
+    munmap(mapping->base, mapping->length);
+    free(mapping);
+  }
+  else if (!pool_free(matrix->data))
+  {
+    free(matrix->data);
+  }
+
+  free(matrix);
+}
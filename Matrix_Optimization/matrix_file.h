@@ -0,0 +1,60 @@
+#ifndef MATRIX_FILE_H
+#define MATRIX_FILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compute.h"
+
+// Binary matrix format that is mmap'd straight into matrix_t->data. A 64-byte header is followed
+// by the row-major int32 payload at `data_offset`, which is 64-byte aligned so the mapping can be
+// used with aligned vector loads. Files without the magic are read with read_matrix() instead.
+
+#define MATRIX_FILE_MAGIC 0x54414D43 // "CMAT" little-endian
+#define MATRIX_FILE_VERSION 1
+#define MATRIX_FILE_ALIGNMENT 64
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t element_size;
+  uint32_t reserved[3];
+  uint64_t data_offset;
+  uint8_t padding[24];
+} matrix_header_t;
+
+// Returns true if the file at path is in the mapped format
+bool is_mapped_matrix(char *path);
+
+// Reads a matrix in either format; mapped files are not copied
+int load_matrix(char *path, matrix_t **matrix);
+
+// Creates a mapped matrix file of the given size and returns a matrix backed by it, so the caller
+// writes the payload in place; the file is complete once the matrix is released
+int create_mapped_matrix(char *path, uint32_t rows, uint32_t cols, matrix_t **matrix);
+
+// Writes a matrix in the mapped format
+int store_mapped_matrix(char *path, matrix_t *matrix);
+
+// Row-band access to mapped matrix files without mapping them, for inputs larger than memory.
+// Both functions return an open file descriptor and fill in the header, or return -1.
+int open_matrix_stream(char *path, matrix_header_t *header);
+int create_matrix_stream(char *path, uint32_t rows, uint32_t cols, matrix_header_t *header);
+
+// Like create_matrix_stream(), but without truncating an existing file, so several processes can
+// each open the same output and write disjoint rows of it
+int share_matrix_stream(char *path, uint32_t rows, uint32_t cols, matrix_header_t *header);
+
+// Reads or writes `rows` rows starting at `row_begin` between a stream and a buffer
+int read_matrix_rows(int fd, const matrix_header_t *header, uint32_t row_begin, uint32_t rows, int32_t *buffer);
+int write_matrix_rows(int fd, const matrix_header_t *header, uint32_t row_begin, uint32_t rows,
+                      const int32_t *buffer);
+
+// Frees a matrix from load_matrix(), load_cached_matrix(), create_mapped_matrix(), pool_matrix() or
+// convolve(), unmapping it or returning its buffer to the pool if needed
+void release_matrix(matrix_t *matrix);
+
+#endif
@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "compute.h"
+#include "matrix_pool.h"
+#include "options.h"
+
+#define DEFAULT_MATRIX_POOL (512L << 20)
+#define DEFAULT_HUGE_PAGES (4L << 20)
+
+#define POOL_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2L << 20)
+
+// Size classes run from 4 KiB up in quarter steps between powers of two, so a buffer is at most a
+// quarter larger than requested
+#define MIN_CLASS_LOG 12
+#define CLASS_STEPS 4
+#define NUM_CLASSES (36 * CLASS_STEPS)
+
+// Buckets of the table that finds the block behind a data pointer on release
+#define LIVE_BUCKETS 1024
+
+typedef struct block
+{
+  int32_t *data;
+  int size_class;
+  struct block *next;
+} block_t;
+
+// Free blocks by size class, and blocks handed out by bucket of their data pointer
+static block_t *free_blocks[NUM_CLASSES];
+static block_t *live_blocks[LIVE_BUCKETS];
+static size_t pooled_bytes;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the size in bytes of the buffers in a size class
+static size_t class_size(int size_class)
+{
+  int log = MIN_CLASS_LOG + size_class / CLASS_STEPS;
+  return (size_t)(CLASS_STEPS + size_class % CLASS_STEPS) << (log - 2);
+}
+
+static size_t bucket_of(int32_t *data)
+{
+  return ((uintptr_t)data / POOL_ALIGNMENT) % LIVE_BUCKETS;
+}
+
+static int32_t *new_buffer(size_t bytes)
+{
+  long huge_pages = get_option_long("huge-pages", DEFAULT_HUGE_PAGES);
+  void *data;
+
+  if (huge_pages > 0 && bytes >= (size_t)huge_pages)
+  {
+    if (posix_memalign(&data, HUGE_PAGE_SIZE, bytes))
+      return NULL;
+    madvise(data, bytes, MADV_HUGEPAGE);
+    return data;
+  }
+
+  return posix_memalign(&data, POOL_ALIGNMENT, bytes) ? NULL : data;
+}
+
+int32_t *pool_alloc(size_t count)
+{
+  int size_class = 0;
+  while (size_class < NUM_CLASSES - 1 && class_size(size_class) < count * sizeof(int32_t))
+    size_class++;
+
+  pthread_mutex_lock(&pool_lock);
+  block_t *block = free_blocks[size_class];
+  if (block != NULL)
+  {
+    free_blocks[size_class] = block->next;
+    pooled_bytes -= class_size(size_class);
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (block == NULL)
+  {
+    int32_t *data = new_buffer(class_size(size_class));
+    block = data != NULL ? malloc(sizeof(block_t)) : NULL;
+    if (block == NULL)
+    {
+      free(data);
+      return NULL;
+    }
+
+    block->data = data;
+    block->size_class = size_class;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  size_t bucket = bucket_of(block->data);
+  block->next = live_blocks[bucket];
+  live_blocks[bucket] = block;
+  pthread_mutex_unlock(&pool_lock);
+
+  return block->data;
+}
+
+bool pool_free(int32_t *data)
+{
+  long capacity = get_option_long("matrix-pool", DEFAULT_MATRIX_POOL);
+
+  pthread_mutex_lock(&pool_lock);
+
+  block_t **link = &live_blocks[bucket_of(data)];
+  while (*link != NULL && (*link)->data != data)
+    link = &(*link)->next;
+
+  block_t *block = *link;
+  if (block == NULL)
+  {
+    pthread_mutex_unlock(&pool_lock);
+    return false;
+  }
+  *link = block->next;
+
+  // Keep the buffer for the next task of its size unless the pool is full
+  size_t bytes = class_size(block->size_class);
+  bool keep = pooled_bytes + bytes <= (size_t)capacity;
+  if (keep)
+  {
+    block->next = free_blocks[block->size_class];
+    free_blocks[block->size_class] = block;
+    pooled_bytes += bytes;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (!keep)
+  {
+    free(block->data);
+    free(block);
+  }
+  return true;
+}
+
+matrix_t *pool_matrix(uint32_t rows, uint32_t cols)
+{
+  int32_t *data = pool_alloc((size_t)rows * cols);
+  matrix_t *matrix = data != NULL ? malloc(sizeof(matrix_t)) : NULL;
+
+  if (matrix == NULL)
+  {
+    if (data != NULL)
+      pool_free(data);
+    fprintf(stderr, "Error: cannot allocate a %u x %u matrix\n", rows, cols);
+    return NULL;
+  }
+
+  matrix->rows = rows;
+  matrix->cols = cols;
+  matrix->data = data;
+  return matrix;
+}
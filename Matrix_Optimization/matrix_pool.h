@@ -0,0 +1,25 @@
+#ifndef MATRIX_POOL_H
+#define MATRIX_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "compute.h"
+
+// Reusable buffers for matrix data. Buffers are 64-byte aligned, rounded up to a size class at most
+// a quarter larger than requested, and kept for reuse when released, so a worker running task after
+// task stops paying for malloc and for faulting in fresh pages. Buffers of at least `huge-pages`
+// bytes (default 4M, 0 disables) are 2 MiB aligned and backed by transparent huge pages. At most
+// `matrix-pool` bytes (default 512M, 0 disables pooling) of free buffers are kept.
+
+// Returns an uninitialized buffer for `count` int32 elements, or NULL if it cannot be allocated
+int32_t *pool_alloc(size_t count);
+
+// Returns a buffer from pool_alloc() to the pool; returns false if data did not come from it
+bool pool_free(int32_t *data);
+
+// Returns a matrix with uninitialized pooled data, to be released with release_matrix(), or prints
+// an error and returns NULL if it cannot be allocated
+matrix_t *pool_matrix(uint32_t rows, uint32_t cols);
+
+#endif
@@ -0,0 +1,345 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coordinator.h"
+#include "mpi_scheduler.h"
+#include "numa.h"
+#include "options.h"
+#include "trace.h"
+
+#define READY 0
+#define NEW_TASK 1
+#define TERMINATE -1
+
+// Task groups with at least this many multiply-adds are split across all ranks (see `split-work`)
+#define DEFAULT_SPLIT_WORK (1L << 36)
+
+// Requests for work each worker keeps outstanding (see `prefetch`)
+#define DEFAULT_PREFETCH 2
+// Most groups sent in one reply
+#define MAX_BATCH_GROUPS 64
+// A reply carries about 1 / BATCH_SHARES of the remaining work per outstanding request
+#define BATCH_SHARES 2
+// Interval at which the manager's dispatcher thread checks for requests
+#define DISPATCH_POLL_NS 50000
+
+typedef struct
+{
+  int64_t work;
+  int32_t group;
+} queued_group_t;
+
+// Orders groups by decreasing work, keeping list order among equals
+static int compare_work(const void *a, const void *b)
+{
+  const queued_group_t *group_a = a, *group_b = b;
+
+  if (group_a->work != group_b->work)
+    return group_a->work < group_b->work ? 1 : -1;
+  return group_a->group - group_b->group;
+}
+
+// Returns the finishing time, in multiply-adds, of the busiest of `workers` workers that each take the
+// next group in `queued` as soon as they are free
+static int64_t estimate_makespan(const queued_group_t *queued, int num_queued, int workers)
+{
+  int64_t *load = calloc(workers, sizeof(int64_t));
+  int64_t makespan = 0;
+
+  for (int q = 0; q < num_queued; q++)
+  {
+    int idlest = 0;
+    for (int w = 1; w < workers; w++)
+    {
+      if (load[w] < load[idlest])
+        idlest = w;
+    }
+
+    load[idlest] += queued[q].work;
+    if (load[idlest] > makespan)
+      makespan = load[idlest];
+  }
+
+  free(load);
+  return makespan;
+}
+
+// Queue of groups shared by the manager's dispatcher thread and its own compute loop
+typedef struct
+{
+  queued_group_t *queued;
+  int num_queued;
+  int next;
+  int64_t remaining;
+  // Takers of work at any one time: every outstanding worker request, plus the manager if it computes
+  int64_t takers;
+  pthread_mutex_t lock;
+  int workers;
+  int prefetch;
+  MPI_Comm comm;
+} dispatch_t;
+
+// Takes the next batch of groups off the queue and returns its size, or 0 once the queue is empty.
+// Batches shrink with the work left (guided scheduling): early ones take many cheap groups in one
+// message, and the last ones are small enough to balance the finish.
+static int take_batch(dispatch_t *dispatch, int32_t *batch)
+{
+  pthread_mutex_lock(&dispatch->lock);
+
+  int64_t target = dispatch->remaining / (dispatch->takers * BATCH_SHARES);
+  int64_t batch_work = 0;
+  int count = 0;
+
+  while (dispatch->next < dispatch->num_queued && count < MAX_BATCH_GROUPS)
+  {
+    queued_group_t *group = &dispatch->queued[dispatch->next];
+
+    if (count > 0 && batch_work + group->work > target)
+      break;
+
+    batch_work += group->work;
+    batch[count++] = group->group;
+    dispatch->next++;
+  }
+  dispatch->remaining -= batch_work;
+
+  pthread_mutex_unlock(&dispatch->lock);
+  return count;
+}
+
+// Runs the groups of one batch with their I/O overlapped, returning -1 if one of them fails
+static int run_batch(task_group_t *groups, int32_t *batch, int count)
+{
+  task_group_t *order[MAX_BATCH_GROUPS];
+  task_t *failed;
+
+  for (int b = 0; b < count; b++)
+    order[b] = &groups[batch[b]];
+
+  // Add your computation function here and call it to execute the task
+  if (execute_task_groups(order, count, &failed))
+  {
+    printf("Task %s failed\n", failed->path);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Answers worker requests until each of the `prefetch` requests of every worker has been told to
+// terminate. This is the only thread of the manager that calls MPI while it runs.
+static void *dispatch_requests(void *arg)
+{
+  dispatch_t *dispatch = arg;
+  int terminated = 0;
+  int32_t batch[MAX_BATCH_GROUPS];
+  int32_t message;
+
+  unpin_thread();
+  while (terminated < dispatch->workers * dispatch->prefetch)
+  {
+    MPI_Status status;
+    int arrived;
+
+    // Poll instead of blocking in MPI_Recv, which busy-waits on the core the compute threads need
+    MPI_Iprobe(MPI_ANY_SOURCE, 0, dispatch->comm, &arrived, &status);
+    if (!arrived)
+    {
+      nanosleep(&(struct timespec){0, DISPATCH_POLL_NS}, NULL);
+      continue;
+    }
+
+    // receive the request (so we know that this node wants more work)
+    MPI_Recv(&message, 1, MPI_INT32_T, status.MPI_SOURCE, 0, dispatch->comm, MPI_STATUS_IGNORE);
+
+    int count = take_batch(dispatch, batch);
+    if (count == 0)
+    {
+      message = TERMINATE;
+      MPI_Send(&message, 1, MPI_INT32_T, status.MPI_SOURCE, 0, dispatch->comm);
+      terminated++;
+      continue;
+    }
+
+    MPI_Send(batch, count, MPI_INT32_T, status.MPI_SOURCE, 0, dispatch->comm);
+  }
+
+  return NULL;
+}
+
+int schedule_task_groups(MPI_Comm comm, int threading, task_group_t *groups, int num_groups)
+{
+  int procID, totalProcs;
+  MPI_Comm_size(comm, &totalProcs);
+  MPI_Comm_rank(comm, &procID);
+
+  // The manager estimates every group's work from the input headers (or file sizes)
+  int64_t *work = calloc(num_groups > 0 ? num_groups : 1, sizeof(int64_t));
+  bool *exact = calloc(num_groups > 0 ? num_groups : 1, sizeof(bool));
+  if (procID == 0)
+  {
+    for (int g = 0; g < num_groups; g++)
+    {
+      exact[g] = true;
+      for (int i = 0; i < groups[g].num_tasks; i++)
+      {
+        bool exact_task;
+        work[g] += task_work(groups[g].tasks[i], &exact_task);
+        exact[g] = exact[g] && exact_task;
+      }
+    }
+  }
+
+  // A group big enough to keep one rank busy while the others idle is instead run by every rank at
+  // once, each computing an equal band of its output rows. The manager decides which groups are
+  // split, and they run before the rest are handed out.
+  char *split = calloc(num_groups > 0 ? num_groups : 1, sizeof(char));
+  if (procID == 0 && totalProcs > 1)
+  {
+    long split_work = get_option_long("split-work", DEFAULT_SPLIT_WORK);
+
+    // Bands are read from and written to mapped files, whose headers also give the exact work
+    for (int g = 0; g < num_groups; g++)
+      split[g] = exact[g] && work[g] >= split_work;
+  }
+  int64_t trace_wait = trace_begin();
+  MPI_Bcast(split, num_groups, MPI_CHAR, 0, comm);
+  trace_end("mpi-wait", NULL, trace_wait);
+
+  int num_queued = 0;
+  queued_group_t *queued = malloc(sizeof(queued_group_t) * (num_groups > 0 ? num_groups : 1));
+  for (int g = 0; g < num_groups; g++)
+  {
+    if (!split[g])
+    {
+      queued[num_queued].work = work[g] > 0 ? work[g] : 1;
+      queued[num_queued].group = g;
+      num_queued++;
+      continue;
+    }
+
+    for (int i = 0; i < groups[g].num_tasks; i++)
+    {
+      if (execute_task_band(groups[g].tasks[i], procID, totalProcs))
+      {
+        printf("Task %s failed\n", groups[g].tasks[i]->path);
+        MPI_Abort(comm, -1);
+      }
+    }
+  }
+
+  // Every worker keeps this many requests for work outstanding, so the next batch is already there
+  // when it finishes the current one. All ranks parse the same options, so they agree on it.
+  int prefetch = get_option_long("prefetch", DEFAULT_PREFETCH);
+  if (prefetch < 1)
+    prefetch = 1;
+
+  // check if the current process is the manager
+  if (procID == 0)
+  {
+    // Manager node. Unless `manager-compute` is 0, it also runs batches on its main thread while a
+    // dispatcher thread answers the workers; a single rank runs everything itself.
+    bool compute =
+        totalProcs == 1 || (get_option_long("manager-compute", 1) && threading >= MPI_THREAD_SERIALIZED);
+    dispatch_t dispatch = {queued, num_queued, 0, 0, (int64_t)(totalProcs - 1) * prefetch + compute,
+                           PTHREAD_MUTEX_INITIALIZER, totalProcs - 1, prefetch, comm};
+
+    // Hand out the largest groups first, so the last ones to finish are short and the tail is even
+    qsort(queued, num_queued, sizeof(queued_group_t), compare_work);
+    for (int q = 0; q < num_queued; q++)
+      dispatch.remaining += queued[q].work;
+
+    int computers = totalProcs - 1 + compute;
+    if (get_option_long("schedule-report", 0) && computers > 0)
+    {
+      int64_t makespan = estimate_makespan(queued, num_queued, computers);
+      double even = (double)dispatch.remaining / computers;
+
+      fprintf(stderr, "Scheduled %d groups on %d workers: estimated makespan %lld multiply-adds, ", num_queued,
+              computers, (long long)makespan);
+      fprintf(stderr, "%.1f%% above an even split\n", even > 0 ? 100.0 * (makespan - even) / even : 0.0);
+    }
+
+    pthread_t dispatcher;
+    if (totalProcs > 1 && compute)
+      pthread_create(&dispatcher, NULL, dispatch_requests, &dispatch);
+    else if (totalProcs > 1)
+      dispatch_requests(&dispatch);
+
+    if (compute)
+    {
+      int32_t batch[MAX_BATCH_GROUPS];
+      int count;
+
+      while ((count = take_batch(&dispatch, batch)) > 0)
+      {
+        if (run_batch(groups, batch, count))
+          MPI_Abort(comm, -1);
+      }
+
+      if (totalProcs > 1)
+        pthread_join(dispatcher, NULL);
+    }
+  }
+  else
+  {
+    // Worker node
+    static const int32_t ready = READY;
+    int32_t(*batches)[MAX_BATCH_GROUPS] = malloc(sizeof(*batches) * prefetch);
+    MPI_Request *receives = malloc(sizeof(MPI_Request) * prefetch);
+    MPI_Request *sends = malloc(sizeof(MPI_Request) * prefetch);
+    int pending = prefetch;
+
+    // Post every receive before asking for work, so replies never wait on an unposted receive
+    for (int s = 0; s < prefetch; s++)
+      MPI_Irecv(batches[s], MAX_BATCH_GROUPS, MPI_INT32_T, 0, 0, comm, &receives[s]);
+    for (int s = 0; s < prefetch; s++)
+      MPI_Isend(&ready, 1, MPI_INT32_T, 0, 0, comm, &sends[s]);
+
+    // Replies arrive in the order the receives were posted, so the slots are served round-robin
+    for (int s = 0; pending > 0; s = (s + 1) % prefetch)
+    {
+      MPI_Status status;
+      int count;
+
+      if (receives[s] == MPI_REQUEST_NULL)
+        continue;
+
+      trace_wait = trace_begin();
+      MPI_Wait(&receives[s], &status);
+      trace_end("mpi-wait", NULL, trace_wait);
+      MPI_Get_count(&status, MPI_INT32_T, &count);
+
+      // if the batch is TERMINATE, this slot is done
+      if (count == 1 && batches[s][0] == TERMINATE)
+      {
+        pending--;
+        continue;
+      }
+
+      // Copy the batch out and ask for the next one right away, before computing this one
+      int32_t batch[MAX_BATCH_GROUPS];
+      memcpy(batch, batches[s], sizeof(int32_t) * count);
+      MPI_Wait(&sends[s], MPI_STATUS_IGNORE);
+      MPI_Irecv(batches[s], MAX_BATCH_GROUPS, MPI_INT32_T, 0, 0, comm, &receives[s]);
+      MPI_Isend(&ready, 1, MPI_INT32_T, 0, 0, comm, &sends[s]);
+
+      if (run_batch(groups, batch, count))
+        return -1;
+    }
+
+    MPI_Waitall(prefetch, sends, MPI_STATUSES_IGNORE);
+    free(batches);
+    free(receives);
+    free(sends);
+  }
+
+  free(work);
+  free(exact);
+  free(split);
+  free(queued);
+  return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef MPI_SCHEDULER_H
+#define MPI_SCHEDULER_H
+
+#include <mpi.h>
+
+#include "tasks.h"
+
+// Runs task groups across the ranks of `comm`, which must all call it with the same groups and
+// options. Rank 0 estimates each group's work; groups big enough to keep one rank busy while the
+// others idle are split into bands run by every rank (`split-work`), and the rest are handed out
+// largest first, in batches that shrink with the work left, to ranks that ask for work (each keeps
+// `prefetch` requests outstanding). Rank 0 also computes batches while a dispatcher thread answers
+// the others, unless `manager-compute` is 0 or `threading` (from MPI_Init_thread()) is below
+// MPI_THREAD_SERIALIZED. A failure on rank 0 or in a split group aborts `comm`; on any other worker
+// it returns -1 with requests still outstanding, and the caller is expected to abort `comm`.
+int schedule_task_groups(MPI_Comm comm, int threading, task_group_t *groups, int num_groups);
+
+#endif
@@ -1,4 +1,5 @@
 #include "compute.h"
+#include "tasks.h"
 
 // #define DEBUG_MODE
 
@@ -95,17 +96,75 @@ int convolve(matrix_t *a_matrix, matrix_t *b_matrix, matrix_t **output_matrix)
   return 0;
 }
 
+// Computes a strided, dilated or multi-channel convolution of two matrices, one kept output at a time
+int convolve_params(matrix_t *a_matrix, matrix_t *b_matrix, const conv_params_t *params, matrix_t **output_matrix)
+{
+  int32_t cols_a = a_matrix->cols;
+  int32_t cols_b = b_matrix->cols;
+  int32_t rows_output, cols_output;
+
+  if (!params_output_size(params, a_matrix->rows, cols_a, b_matrix->rows, cols_b, &rows_output, &cols_output))
+    return -1;
+
+  // Rows of one channel of A, of one kernel of B, and of one filter's block of the output
+  int32_t rows_channel = a_matrix->rows / params->channels;
+  int32_t rows_b = b_matrix->rows / params->channels / params->filters;
+  int32_t rows_filter = rows_output / params->filters;
+
+  *output_matrix = malloc(sizeof(matrix_t));
+  (*output_matrix)->rows = rows_output;
+  (*output_matrix)->cols = cols_output;
+  (*output_matrix)->data = malloc(sizeof(int32_t) * rows_output * cols_output);
+
+  for (int32_t m = 0; m < params->filters; m++)
+  {
+    for (int32_t i = 0; i < rows_filter; i++)
+    {
+      for (int32_t j = 0; j < cols_output; j++)
+      {
+        int32_t sum = 0;
+
+        for (int32_t ch = 0; ch < params->channels; ch++)
+        {
+          int32_t *channel = &a_matrix->data[ch * rows_channel * cols_a];
+          int32_t *kernel = &b_matrix->data[(m * params->channels + ch) * rows_b * cols_b];
+
+          for (int32_t k = 0; k < rows_b; k++)
+          {
+            for (int32_t c = 0; c < cols_b; c++)
+            {
+              int32_t row = i * params->stride_rows + k * params->dilation_rows;
+              int32_t col = j * params->stride_cols + c * params->dilation_cols;
+
+              // The flipped kernel at (k, c) is the original at (rows_b - 1 - k, cols_b - 1 - c)
+              sum += channel[row * cols_a + col] * kernel[(rows_b - 1 - k) * cols_b + (cols_b - 1 - c)];
+            }
+          }
+        }
+
+        (*output_matrix)->data[(m * rows_filter + i) * cols_output + j] = sum;
+      }
+    }
+  }
+
+  return 0;
+}
+
 // Executes a task
 int execute_task(task_t *task)
 {
   matrix_t *a_matrix, *b_matrix, *output_matrix;
+  conv_params_t params;
 
+  if (read_task_params(task, &params))
+    return -1;
   if (read_matrix(get_a_matrix_path(task), &a_matrix))
     return -1;
   if (read_matrix(get_b_matrix_path(task), &b_matrix))
     return -1;
 
-  if (convolve(a_matrix, b_matrix, &output_matrix))
+  if (dense_params(&params) ? convolve(a_matrix, b_matrix, &output_matrix)
+                            : convolve_params(a_matrix, b_matrix, &params, &output_matrix))
     return -1;
 
   if (write_matrix(get_output_matrix_path(task), output_matrix))
@@ -119,3 +178,40 @@ int execute_task(task_t *task)
   free(output_matrix);
   return 0;
 }
+
+// Executes tasks that share an A matrix; the naive version simply runs them one by one
+int execute_task_batch(task_t **tasks, int num_tasks)
+{
+  for (int i = 0; i < num_tasks; i++)
+  {
+    if (execute_task(tasks[i]))
+      return -1;
+  }
+
+  return 0;
+}
+
+// Executes groups of tasks; the naive version runs them one after another without overlapping I/O
+int execute_task_groups(task_group_t **groups, int num_groups, task_t **failed)
+{
+  for (int g = 0; g < num_groups; g++)
+  {
+    for (int i = 0; i < groups[g]->num_tasks; i++)
+    {
+      if (execute_task(groups[g]->tasks[i]))
+      {
+        *failed = groups[g]->tasks[i];
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Executes one band of a split task; the naive version runs the whole task as the first band
+int execute_task_band(task_t *task, int band, int num_bands)
+{
+  (void)num_bands;
+  return band == 0 ? execute_task(task) : 0;
+}
@@ -0,0 +1,245 @@
+#include <omp.h>
+#include <pthread.h>
+#include <x86intrin.h>
+
+#include "compute.h"
+#include "kernels.h"
+
+// Inputs whose values all fit in 16 bits are convolved two kernel columns at a time with pmaddwd,
+// which multiplies pairs of 16-bit values and adds each pair into a 32-bit lane in one instruction,
+// where the 32-bit path needs a multiply (two uops on most cores) and an add per coefficient.
+//
+// The A window of each output tile is rewritten as pairs while it is in cache: pairs[i][j] holds
+// a[i][j] in its low half and a[i][j + 1] in its high half, so the 32-bit lane for output column j,
+// loaded at pairs[i][j + c], meets the kernel pair (b[c], b[c + 1]) broadcast from paired_b. Products are exact in 32 bits and the adds wrap
+// like the 32-bit path, so results are bit-identical whenever the inputs are in range.
+
+// Output rows computed together by one microkernel call
+#define NARROW_BLOCK_ROWS 4
+
+static int32_t pack_pair(int32_t low, int32_t high)
+{
+  return (int32_t)((uint32_t)(uint16_t)low | (uint32_t)(uint16_t)high << 16);
+}
+
+static bool fits_narrow(int32_t value)
+{
+  return value >= INT16_MIN && value <= INT16_MAX;
+}
+
+int32_t *narrow_pack_kernel(const int32_t *flipped_b, int32_t rows_b, int32_t cols_b)
+{
+  int32_t pairs = (cols_b + 1) / 2;
+  int32_t *paired_b = malloc(sizeof(int32_t) * rows_b * pairs);
+
+  for (int32_t k = 0; k < rows_b; k++)
+  {
+    for (int32_t p = 0; p < pairs; p++)
+    {
+      int32_t low = flipped_b[k * cols_b + 2 * p];
+      int32_t high = 2 * p + 1 < cols_b ? flipped_b[k * cols_b + 2 * p + 1] : 0;
+
+      if (!fits_narrow(low) || !fits_narrow(high))
+      {
+        free(paired_b);
+        return NULL;
+      }
+      paired_b[k * pairs + p] = pack_pair(low, high);
+    }
+  }
+
+  return paired_b;
+}
+
+bool narrow_pair_rows(const int32_t *a, int32_t rows, int32_t cols, int32_t stride, int32_t *pairs)
+{
+  for (int32_t i = 0; i < rows; i++)
+  {
+    const int32_t *a_row = &a[(size_t)i * stride];
+    int32_t *pair_row = &pairs[(size_t)i * cols];
+    int32_t min = 0, max = 0;
+
+    // Branch-free, so the compiler vectorizes it; the last element pairs with zero
+    for (int32_t j = 0; j < cols - 1; j++)
+    {
+      min = a_row[j] < min ? a_row[j] : min;
+      max = a_row[j] > max ? a_row[j] : max;
+      pair_row[j] = pack_pair(a_row[j], a_row[j + 1]);
+    }
+    min = a_row[cols - 1] < min ? a_row[cols - 1] : min;
+    max = a_row[cols - 1] > max ? a_row[cols - 1] : max;
+    pair_row[cols - 1] = pack_pair(a_row[cols - 1], 0);
+
+    // Once any row is out of range the caller falls back, so the rest need not be paired
+    if (!fits_narrow(min) || !fits_narrow(max))
+      return false;
+  }
+
+  return true;
+}
+
+// Microkernel: keeps `rows` x (8 * `vectors`) outputs in registers; a partial last vector only
+// loads and stores the lanes set in `mask`
+__attribute__((target("avx2"), always_inline)) static inline void block_avx2(const conv_args_t *args, int32_t i,
+                                                                               int32_t j, int32_t rows,
+                                                                               int32_t vectors, __m256i mask)
+{
+  __m256i acc[NARROW_BLOCK_ROWS][2];
+  int32_t pairs = (args->cols_b + 1) / 2;
+  int32_t *paired_b_index = args->flipped_b;
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    acc[r][0] = _mm256_setzero_si256();
+    acc[r][1] = _mm256_setzero_si256();
+  }
+
+  for (int32_t k = 0; k < args->rows_b; k++)
+  {
+    int32_t *pair_row = &args->a[(size_t)(i + k) * args->cols_a + j];
+
+    for (int32_t p = 0; p < pairs; p++, paired_b_index++)
+    {
+      __m256i coef = _mm256_set1_epi32(*paired_b_index);
+
+      for (int32_t r = 0; r < rows; r++)
+      {
+        int32_t *pair_index = pair_row + (size_t)r * args->cols_a + 2 * p;
+
+        if (vectors == 2)
+        {
+          acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_madd_epi16(_mm256_loadu_si256((__m256i *)pair_index), coef));
+          acc[r][1] = _mm256_add_epi32(acc[r][1],
+                                       _mm256_madd_epi16(_mm256_loadu_si256((__m256i *)(pair_index + 8)), coef));
+        }
+        else
+        {
+          acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_madd_epi16(_mm256_maskload_epi32(pair_index, mask), coef));
+        }
+      }
+    }
+  }
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    int32_t *output_index = &args->output[(size_t)(i + r) * args->cols_output + j];
+
+    if (vectors == 2)
+    {
+      _mm256_storeu_si256((__m256i *)output_index, acc[r][0]);
+      _mm256_storeu_si256((__m256i *)(output_index + 8), acc[r][1]);
+    }
+    else
+    {
+      _mm256_maskstore_epi32(output_index, mask, acc[r][0]);
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void region_avx2(const conv_args_t *args, int32_t row_begin, int32_t row_end,
+                                                        int32_t col_begin, int32_t col_end)
+{
+  __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  for (int32_t i = row_begin; i < row_end; i += NARROW_BLOCK_ROWS)
+  {
+    int32_t rows = row_end - i < NARROW_BLOCK_ROWS ? row_end - i : NARROW_BLOCK_ROWS;
+    int32_t j = col_begin;
+
+    for (; j + 16 <= col_end; j += 16)
+      block_avx2(args, i, j, rows, 2, lane_index);
+    for (; j < col_end; j += 8)
+      block_avx2(args, i, j, rows, 1, _mm256_cmpgt_epi32(_mm256_set1_epi32(col_end - j), lane_index));
+  }
+}
+
+// Microkernel: keeps `rows` x (16 * `vectors`) outputs in registers; a partial last vector only
+// loads and stores the lanes set in `mask`
+__attribute__((target("avx512f,avx512bw"), always_inline)) static inline void block_avx512(const conv_args_t *args,
+                                                                                         int32_t i, int32_t j,
+                                                                                         int32_t rows,
+                                                                                         int32_t vectors,
+                                                                                         __mmask16 mask)
+{
+  __m512i acc[NARROW_BLOCK_ROWS][2];
+  int32_t pairs = (args->cols_b + 1) / 2;
+  int32_t *paired_b_index = args->flipped_b;
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    acc[r][0] = _mm512_setzero_si512();
+    acc[r][1] = _mm512_setzero_si512();
+  }
+
+  for (int32_t k = 0; k < args->rows_b; k++)
+  {
+    int32_t *pair_row = &args->a[(size_t)(i + k) * args->cols_a + j];
+
+    for (int32_t p = 0; p < pairs; p++, paired_b_index++)
+    {
+      __m512i coef = _mm512_set1_epi32(*paired_b_index);
+
+      for (int32_t r = 0; r < rows; r++)
+      {
+        int32_t *pair_index = pair_row + (size_t)r * args->cols_a + 2 * p;
+
+        if (vectors == 2)
+        {
+          acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_madd_epi16(_mm512_loadu_si512(pair_index), coef));
+          acc[r][1] = _mm512_add_epi32(acc[r][1], _mm512_madd_epi16(_mm512_loadu_si512(pair_index + 16), coef));
+        }
+        else
+        {
+          acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_madd_epi16(_mm512_maskz_loadu_epi32(mask, pair_index), coef));
+        }
+      }
+    }
+  }
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    int32_t *output_index = &args->output[(size_t)(i + r) * args->cols_output + j];
+
+    if (vectors == 2)
+    {
+      _mm512_storeu_si512(output_index, acc[r][0]);
+      _mm512_storeu_si512(output_index + 16, acc[r][1]);
+    }
+    else
+    {
+      _mm512_mask_storeu_epi32(output_index, mask, acc[r][0]);
+    }
+  }
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void region_avx512(const conv_args_t *args, int32_t row_begin,
+                                                                      int32_t row_end, int32_t col_begin,
+                                                                      int32_t col_end)
+{
+  for (int32_t i = row_begin; i < row_end; i += NARROW_BLOCK_ROWS)
+  {
+    int32_t rows = row_end - i < NARROW_BLOCK_ROWS ? row_end - i : NARROW_BLOCK_ROWS;
+    int32_t j = col_begin;
+
+    for (; j + 32 <= col_end; j += 32)
+      block_avx512(args, i, j, rows, 2, 0xFFFF);
+    for (; j < col_end; j += 16)
+      block_avx512(args, i, j, rows, 1, col_end - j >= 16 ? 0xFFFF : (__mmask16)((1u << (col_end - j)) - 1));
+  }
+}
+
+static void (*region)(const conv_args_t *, int32_t, int32_t, int32_t, int32_t);
+static pthread_once_t region_once = PTHREAD_ONCE_INIT;
+
+// 16-bit multiply-adds on 512-bit vectors also need AVX-512BW, which the 32-bit kernels do not
+static void select_region()
+{
+  __builtin_cpu_init();
+  region = kernel_isa() >= ISA_AVX512 && __builtin_cpu_supports("avx512bw") ? region_avx512 : region_avx2;
+}
+
+void narrow_region(const conv_args_t *args, int32_t row_begin, int32_t row_end, int32_t col_begin, int32_t col_end)
+{
+  pthread_once(&region_once, select_region);
+  region(args, row_begin, row_end, col_begin, col_end);
+}
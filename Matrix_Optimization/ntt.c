@@ -0,0 +1,316 @@
+#include <omp.h>
+
+#include "compute.h"
+#include "kernels.h"
+
+// Exact convolution through number-theoretic transforms. A is flattened row-major with its own
+// width, and B is laid out with the same row stride, so the 2D convolution becomes a 1D one in
+// which every valid output lands on a distinct index without wrapping across rows. The products are
+// computed modulo three NTT-friendly primes and recombined with the CRT; their product (~2^87) holds
+// any exact sum of up to 2^24 int32 products, and the low 32 bits of that sum are exactly the
+// wrapped result of the direct loop.
+//
+// Long inputs are split into bands of output rows (overlap-save): each band reads its A rows plus a
+// (rows_b - 1)-row halo, and one transform size is reused for every band.
+
+#define NTT_PRIMES 3
+// Largest transform size, limited by the 2-adic order of the smallest prime
+#define NTT_MAX_LOG 25
+// Transform size aimed for per band; large enough to amortize the halo, small enough to stay in L2/L3
+#define NTT_TARGET_LOG 20
+// Largest kernel whose exact sums fit in the CRT range
+#define NTT_MAX_KERNEL_SIZE (1 << 24)
+
+typedef struct
+{
+  uint32_t p;
+  uint32_t g;
+} ntt_prime_t;
+
+static const ntt_prime_t primes[NTT_PRIMES] = {
+    {2013265921, 31},
+    {469762049, 3},
+    {167772161, 3},
+};
+
+static inline uint32_t mul_mod(uint32_t a, uint32_t b, uint32_t p)
+{
+  return (uint64_t)a * b % p;
+}
+
+static uint32_t pow_mod(uint32_t base, uint64_t exponent, uint32_t p)
+{
+  uint32_t result = 1;
+
+  for (; exponent; exponent >>= 1, base = mul_mod(base, base, p))
+  {
+    if (exponent & 1)
+      result = mul_mod(result, base, p);
+  }
+
+  return result;
+}
+
+// Twiddle factors for both directions of one prime, stored per stage so every butterfly pass reads
+// them contiguously: the stage with half-length h uses entries [h, 2h), holding w^(j * n / 2h)
+typedef struct
+{
+  uint32_t *forward;
+  uint32_t *inverse;
+  uint32_t n_inverse;
+} ntt_roots_t;
+
+static void ntt_roots_init(ntt_roots_t *roots, const ntt_prime_t *prime, uint32_t n)
+{
+  uint32_t p = prime->p;
+  uint32_t w = pow_mod(prime->g, (p - 1) / n, p);
+  uint32_t w_inverse = pow_mod(w, p - 2, p);
+
+  roots->forward = malloc(sizeof(uint32_t) * n);
+  roots->inverse = malloc(sizeof(uint32_t) * n);
+
+  // The last stage uses every power of w; each earlier stage uses every other entry of the next one
+  if (n > 1)
+  {
+    roots->forward[n / 2] = roots->inverse[n / 2] = 1;
+    for (uint32_t j = 1; j < n / 2; j++)
+    {
+      roots->forward[n / 2 + j] = mul_mod(roots->forward[n / 2 + j - 1], w, p);
+      roots->inverse[n / 2 + j] = mul_mod(roots->inverse[n / 2 + j - 1], w_inverse, p);
+    }
+  }
+  for (uint32_t half = n / 4; half >= 1; half >>= 1)
+  {
+    for (uint32_t j = 0; j < half; j++)
+    {
+      roots->forward[half + j] = roots->forward[2 * half + 2 * j];
+      roots->inverse[half + j] = roots->inverse[2 * half + 2 * j];
+    }
+  }
+  roots->n_inverse = pow_mod(n, p - 2, p);
+}
+
+// In-place iterative radix-2 transform of size n (a power of two). Always inlined into ntt() with a
+// constant p, which lets the compiler replace every `% p` with a multiply by its reciprocal.
+__attribute__((always_inline)) static inline void ntt_prime(uint32_t *x, uint32_t n, const uint32_t p,
+                                                            const ntt_roots_t *roots, bool inverse)
+{
+  const uint32_t *twiddle = inverse ? roots->inverse : roots->forward;
+
+  for (uint32_t i = 1, j = 0; i < n; i++)
+  {
+    uint32_t bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+
+    if (i < j)
+    {
+      uint32_t tmp = x[i];
+      x[i] = x[j];
+      x[j] = tmp;
+    }
+  }
+
+  for (uint32_t len = 2; len <= n; len <<= 1)
+  {
+    uint32_t half = len >> 1;
+    const uint32_t *stage = twiddle + half;
+
+    for (uint32_t i = 0; i < n; i += len)
+    {
+      for (uint32_t j = 0; j < half; j++)
+      {
+        uint32_t u = x[i + j];
+        uint32_t v = mul_mod(x[i + j + half], stage[j], p);
+
+        x[i + j] = u + v >= p ? u + v - p : u + v;
+        x[i + j + half] = u >= v ? u - v : u + p - v;
+      }
+    }
+  }
+
+  if (inverse)
+  {
+    for (uint32_t i = 0; i < n; i++)
+      x[i] = mul_mod(x[i], roots->n_inverse, p);
+  }
+}
+
+static void ntt(uint32_t *x, uint32_t n, int32_t q, const ntt_roots_t *roots, bool inverse)
+{
+  switch (q)
+  {
+  case 0:
+    ntt_prime(x, n, 2013265921, roots, inverse);
+    break;
+  case 1:
+    ntt_prime(x, n, 469762049, roots, inverse);
+    break;
+  default:
+    ntt_prime(x, n, 167772161, roots, inverse);
+    break;
+  }
+}
+
+// Multiplies x by y element-wise modulo p, with the same constant-p inlining as ntt_prime()
+__attribute__((always_inline)) static inline void pointwise_prime(uint32_t *x, const uint32_t *y, uint32_t n,
+                                                                  const uint32_t p)
+{
+  for (uint32_t i = 0; i < n; i++)
+    x[i] = mul_mod(x[i], y[i], p);
+}
+
+static void pointwise(uint32_t *x, const uint32_t *y, uint32_t n, int32_t q)
+{
+  switch (q)
+  {
+  case 0:
+    pointwise_prime(x, y, n, 2013265921);
+    break;
+  case 1:
+    pointwise_prime(x, y, n, 469762049);
+    break;
+  default:
+    pointwise_prime(x, y, n, 167772161);
+    break;
+  }
+}
+
+static inline uint32_t to_residue(int32_t value, uint32_t p)
+{
+  int64_t r = value % (int64_t)p;
+  return r < 0 ? r + p : r;
+}
+
+// Returns log2 of the transform size used for a kernel of rows_b rows over an A of the given shape,
+// or -1 if no supported size fits one output row plus its halo
+static int32_t ntt_log_size(int32_t rows_a, int32_t cols_a, int32_t rows_b)
+{
+  int64_t band_min = (int64_t)rows_b * cols_a;
+  int64_t whole = (int64_t)rows_a * cols_a;
+  int32_t log = NTT_TARGET_LOG;
+
+  // Grow past the target when a single band would be mostly halo, shrink when A is small
+  while (log < NTT_MAX_LOG && (1LL << log) < 2 * band_min)
+    log++;
+  while (log > 1 && (1LL << (log - 1)) >= whole)
+    log--;
+
+  return (1LL << log) >= band_min ? log : -1;
+}
+
+bool ntt_supported(int32_t rows_a, int32_t cols_a, int32_t rows_b, int32_t cols_b)
+{
+  return (int64_t)rows_b * cols_b <= NTT_MAX_KERNEL_SIZE && ntt_log_size(rows_a, cols_a, rows_b) >= 0;
+}
+
+size_t ntt_scratch_size(const conv_args_t *args)
+{
+  int32_t rows_a = args->rows_output + args->rows_b - 1;
+  size_t n = (size_t)1 << ntt_log_size(rows_a, args->cols_a, args->rows_b);
+
+  // For each prime: two root tables, the transform of B, and one transform per thread
+  return sizeof(uint32_t) * n * NTT_PRIMES * (3 + omp_get_max_threads());
+}
+
+void ntt_convolve(const conv_args_t *args)
+{
+  int32_t rows_b = args->rows_b;
+  int32_t cols_b = args->cols_b;
+  int32_t cols_a = args->cols_a;
+  int32_t rows_a = args->rows_output + rows_b - 1;
+  uint32_t n = 1u << ntt_log_size(rows_a, cols_a, rows_b);
+
+  // Output rows per band: the band's A rows, halo included, must fit in one transform
+  int32_t band_rows = n / cols_a - rows_b + 1;
+  int32_t bands = (args->rows_output + band_rows - 1) / band_rows;
+
+  ntt_roots_t roots[NTT_PRIMES];
+  uint32_t *b_transform[NTT_PRIMES];
+
+  // Transform B once; the flip is undone because the NTT computes a true convolution
+  for (int32_t q = 0; q < NTT_PRIMES; q++)
+  {
+    uint32_t p = primes[q].p;
+
+    ntt_roots_init(&roots[q], &primes[q], n);
+    b_transform[q] = calloc(n, sizeof(uint32_t));
+    for (int32_t k = 0; k < rows_b; k++)
+    {
+      for (int32_t c = 0; c < cols_b; c++)
+      {
+        int32_t value = args->flipped_b[(rows_b - 1 - k) * cols_b + (cols_b - 1 - c)];
+        b_transform[q][(size_t)k * cols_a + c] = to_residue(value, p);
+      }
+    }
+    ntt(b_transform[q], n, q, &roots[q], false);
+  }
+
+  // Garner constants for recombining the three residues
+  uint32_t p0 = primes[0].p, p1 = primes[1].p, p2 = primes[2].p;
+  uint32_t p0_inverse = pow_mod(p0 % p1, p1 - 2, p1);
+  uint32_t p0p1_inverse = pow_mod(mul_mod(p0 % p2, p1 % p2, p2), p2 - 2, p2);
+  unsigned __int128 modulus = (unsigned __int128)p0 * p1 * p2;
+
+#pragma omp parallel
+  {
+    uint32_t *x[NTT_PRIMES];
+    for (int32_t q = 0; q < NTT_PRIMES; q++)
+      x[q] = malloc(sizeof(uint32_t) * n);
+
+#pragma omp for schedule(dynamic)
+    for (int32_t band = 0; band < bands; band++)
+    {
+      int32_t row_begin = band * band_rows;
+      int32_t row_end = row_begin + band_rows < args->rows_output ? row_begin + band_rows : args->rows_output;
+      size_t band_size = (size_t)(row_end - row_begin + rows_b - 1) * cols_a;
+      int32_t *a_band = &args->a[(size_t)row_begin * cols_a];
+
+      for (int32_t q = 0; q < NTT_PRIMES; q++)
+      {
+        uint32_t p = primes[q].p;
+
+        for (size_t i = 0; i < band_size; i++)
+          x[q][i] = to_residue(a_band[i], p);
+        memset(x[q] + band_size, 0, sizeof(uint32_t) * (n - band_size));
+
+        ntt(x[q], n, q, &roots[q], false);
+        pointwise(x[q], b_transform[q], n, q);
+        ntt(x[q], n, q, &roots[q], true);
+      }
+
+      // Output (i, j) of the band sits at flat index (i + rows_b - 1) * cols_a + j + cols_b - 1
+      for (int32_t i = row_begin; i < row_end; i++)
+      {
+        int32_t *output_row = &args->output[(size_t)i * args->cols_output];
+        size_t base = (size_t)(i - row_begin + rows_b - 1) * cols_a + cols_b - 1;
+
+        for (int32_t j = 0; j < args->cols_output; j++)
+        {
+          uint32_t r0 = x[0][base + j], r1 = x[1][base + j], r2 = x[2][base + j];
+          uint32_t a1 = mul_mod((r1 + p1 - r0 % p1) % p1, p0_inverse, p1);
+          uint32_t a2 = (r2 + p2 - (r0 + mul_mod(a1, p0 % p2, p2)) % p2) % p2;
+          a2 = mul_mod(a2, p0p1_inverse, p2);
+
+          unsigned __int128 value = r0 + (unsigned __int128)a1 * p0 + (unsigned __int128)a2 * p0 * p1;
+
+          // Values above half the modulus stand for negative sums
+          if (value > modulus / 2)
+            value -= modulus;
+          output_row[j] = (int32_t)(uint32_t)value;
+        }
+      }
+    }
+
+    for (int32_t q = 0; q < NTT_PRIMES; q++)
+      free(x[q]);
+  }
+
+  for (int32_t q = 0; q < NTT_PRIMES; q++)
+  {
+    free(roots[q].forward);
+    free(roots[q].inverse);
+    free(b_transform[q]);
+  }
+}
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+
+#include <omp.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "numa.h"
+
+#define NODE_PATH "/sys/devices/system/node"
+
+// The CPUs the process was bound to, for threads that must not stay on one CPU
+static cpu_set_t bound_cpus;
+static bool bound;
+
+// Reads a sysfs list such as "0-3,8-11" into set; returns false if the file cannot be read
+static bool read_list(const char *path, cpu_set_t *set)
+{
+  FILE *file = fopen(path, "r");
+  int first, last;
+
+  CPU_ZERO(set);
+  if (file == NULL)
+    return false;
+
+  while (fscanf(file, "%d", &first) == 1)
+  {
+    last = first;
+    if (fscanf(file, "-%d", &last) != 1)
+      last = first;
+
+    for (int i = first; i <= last && i < CPU_SETSIZE; i++)
+      CPU_SET(i, set);
+
+    if (fgetc(file) != ',')
+      break;
+  }
+
+  fclose(file);
+  return true;
+}
+
+int bind_numa(int local_rank, int local_size)
+{
+  cpu_set_t online, node_cpus, cpus;
+  int nodes[CPU_SETSIZE];
+  int num_nodes = 0;
+
+  if (!read_list(NODE_PATH "/online", &online))
+    return 0;
+  for (int i = 0; i < CPU_SETSIZE; i++)
+  {
+    if (CPU_ISSET(i, &online))
+      nodes[num_nodes++] = i;
+  }
+  if (num_nodes == 0 || local_size < 1)
+    return 0;
+
+  CPU_ZERO(&cpus);
+  if (local_size <= num_nodes)
+  {
+    // Whole domains: this process takes every local_size-th one
+    for (int n = local_rank; n < num_nodes; n += local_size)
+    {
+      char path[64];
+      snprintf(path, sizeof(path), NODE_PATH "/node%d/cpulist", nodes[n]);
+      if (read_list(path, &node_cpus))
+        CPU_OR(&cpus, &cpus, &node_cpus);
+    }
+  }
+  else
+  {
+    // Several processes per domain: each takes an equal, contiguous slice of the domain's CPUs
+    int node = local_rank % num_nodes;
+    int sharing = (local_size - node + num_nodes - 1) / num_nodes;
+    int slot = local_rank / num_nodes;
+    char path[64];
+
+    snprintf(path, sizeof(path), NODE_PATH "/node%d/cpulist", nodes[node]);
+    if (!read_list(path, &node_cpus))
+      return 0;
+
+    int count = CPU_COUNT(&node_cpus);
+    int begin = count * slot / sharing;
+    int end = count * (slot + 1) / sharing;
+
+    for (int i = 0, seen = 0; i < CPU_SETSIZE && seen < end; i++)
+    {
+      if (!CPU_ISSET(i, &node_cpus))
+        continue;
+      if (seen >= begin)
+        CPU_SET(i, &cpus);
+      seen++;
+    }
+  }
+
+  // Threads started from here on, OpenMP's included, inherit the mask
+  if (CPU_COUNT(&cpus) == 0 || sched_setaffinity(0, sizeof(cpus), &cpus))
+    return 0;
+  bound_cpus = cpus;
+  bound = true;
+
+  int count = CPU_COUNT(&cpus);
+  int *cpu_list = malloc(sizeof(int) * count);
+  for (int i = 0, n = 0; i < CPU_SETSIZE; i++)
+  {
+    if (CPU_ISSET(i, &cpus))
+      cpu_list[n++] = i;
+  }
+
+  if (getenv("OMP_NUM_THREADS") == NULL)
+    omp_set_num_threads(count);
+
+  // Pin each OpenMP worker thread to one CPU; the runtime keeps its threads, so the pinning holds for
+  // every later parallel region. Thread 0 is the main thread, which keeps the whole mask: the
+  // dispatcher and I/O threads it starts later would otherwise inherit a single CPU and share it
+  // with the compute thread running there
+#pragma omp parallel
+  {
+    cpu_set_t thread_cpu;
+
+    if (omp_get_thread_num() != 0)
+    {
+      CPU_ZERO(&thread_cpu);
+      CPU_SET(cpu_list[omp_get_thread_num() % count], &thread_cpu);
+      sched_setaffinity(0, sizeof(thread_cpu), &thread_cpu);
+    }
+  }
+
+  free(cpu_list);
+  return count;
+}
+
+void unpin_thread()
+{
+  if (bound)
+    sched_setaffinity(0, sizeof(bound_cpus), &bound_cpus);
+}
@@ -0,0 +1,17 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+// Binds this process and its OpenMP threads to a share of the node's NUMA domains. The `local_size`
+// processes on a node, numbered by `local_rank`, split the domains between them when there are at
+// least as many domains as processes, or else share a domain and split its CPUs. The OpenMP thread
+// count is set to the number of CPUs bound (unless OMP_NUM_THREADS is set) so processes never
+// oversubscribe cores, and each worker thread is pinned to one CPU, so the pages it touches first
+// are allocated on its own domain. The calling thread, OpenMP's thread 0, keeps every CPU bound.
+// Returns the number of CPUs bound, or 0 if nothing was changed.
+int bind_numa(int local_rank, int local_size);
+
+// Gives the calling thread every CPU bind_numa() bound the process to, for helper threads such as
+// the dispatcher and the I/O stage; does nothing if the process was not bound
+void unpin_thread();
+
+#endif
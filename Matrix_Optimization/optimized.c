@@ -1,7 +1,17 @@
 #include <omp.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <x86intrin.h>
 
 #include "compute.h"
+#include "kernels.h"
+#include "matrix_cache.h"
+#include "matrix_file.h"
+#include "matrix_pool.h"
+#include "numa.h"
+#include "options.h"
+#include "tasks.h"
+#include "trace.h"
 
 // #define DEBUG_MODE
 
@@ -15,6 +25,85 @@
 #define debug_print_m(...)
 #endif
 
+// Output rows computed together by one microkernel call
+#define BLOCK_ROWS 4
+
+// Output tiles are sized so their A window and output fit in this share of L2
+#define TILE_L2_FRACTION 2
+// Tiles per thread wanted for load balancing before tiles are shrunk below L2 size
+#define TILES_PER_THREAD 4
+// Smallest tile width; one AVX-512 microkernel block
+#define TILE_MIN_COLS 32
+#define TILE_MAX_COLS 512
+
+// A tiles shared by all kernels of a batch
+#define BATCH_TILE_ROWS 32
+#define BATCH_TILE_COLS 256
+
+// Convolution engines, selected per call from the kernel size
+typedef enum
+{
+  ENGINE_DIRECT,
+  ENGINE_GEMM,
+  ENGINE_NTT,
+  ENGINE_SEPARABLE,
+  ENGINE_SPARSE,
+  ENGINE_NARROW,
+  ENGINE_COUNT
+} engine_t;
+
+static const char *engine_names[ENGINE_COUNT] = {
+    [ENGINE_DIRECT] = "direct",
+    [ENGINE_GEMM] = "gemm",
+    [ENGINE_NTT] = "ntt",
+    [ENGINE_SEPARABLE] = "separable",
+    [ENGINE_SPARSE] = "sparse",
+    [ENGINE_NARROW] = "narrow",
+};
+
+// Smallest kernel for which the GEMM engine beats the direct microkernel; its register reuse
+// comes from the kernel rows, so short kernels stay on the direct path
+#define GEMM_MIN_KERNEL_SIZE 576
+#define GEMM_MIN_KERNEL_ROWS 16
+
+// Smallest kernel for which the O(N log N) NTT engine beats the O(N * K) direct loops
+#define NTT_MIN_KERNEL_SIZE 16384
+
+// Densest kernel, in percent of nonzero coefficients, that runs on the sparse engine, and the
+// smallest kernel it is considered for. Each sparse pass moves the output tile through L1, so it
+// only beats the register-blocked direct microkernel when a good share of coefficients are zero.
+#define SPARSE_MAX_DENSITY 40
+#define SPARSE_MIN_KERNEL_SIZE 25
+
+// Smallest kernel for which the 16-bit path pays for pairing up A first; below it the 32-bit
+// kernels with compile-time sizes are as fast
+#define NARROW_MIN_KERNEL_SIZE 64
+
+// Computes output rows [row_begin, row_end) and columns [col_begin, col_end)
+typedef void (*region_fn)(const conv_args_t *args, int32_t row_begin, int32_t row_end, int32_t col_begin,
+                          int32_t col_end);
+
+// Kernel shapes common enough to get region kernels with compile-time sizes
+typedef enum
+{
+  SHAPE_3X3,
+  SHAPE_5X5,
+  SHAPE_7X7,
+  SHAPE_1XN,
+  SHAPE_NX1,
+  SHAPE_COUNT
+} shape_t;
+
+// A family of kernels built for one instruction set
+typedef struct
+{
+  const char *name;
+  int32_t lanes;
+  int32_t (*dot)(uint32_t n, int32_t *vec1, int32_t *vec2);
+  region_fn region;
+  region_fn shapes[SHAPE_COUNT];
+} kernel_t;
+
 void print_m(int32_t row, int32_t col, int32_t *vec)
 {
   for (int i = 0; i < row; i++)
@@ -27,20 +116,65 @@ void print_m(int32_t row, int32_t col, int32_t *vec)
   }
 }
 
-// Computes the dot product of vec1 and vec2, both of size n
-int32_t dot(uint32_t n, int32_t *vec1, int32_t *vec2)
+// Computes the dot product of vec1 and vec2, both of size n, one element at a time
+static int32_t dot_scalar(uint32_t n, int32_t *vec1, int32_t *vec2)
 {
-  // implement dot product of vec1 and vec2, both of size n
   int32_t result = 0;
+
+  for (uint32_t i = 0; i < n; i++)
+  {
+    result += vec1[i] * vec2[i];
+  }
+
+  return result;
+}
+
+// Computes the dot product of vec1 and vec2, both of size n, 4 lanes at a time
+__attribute__((target("sse4.1"))) static int32_t dot_sse41(uint32_t n, int32_t *vec1, int32_t *vec2)
+{
   int32_t i;
-  int32_t end = n - 32;
-  __m256i tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7, tmp8;
-  __m256i mul, mul2, mul3, mul4;
+  int32_t end = (int32_t)n - 15;
+  __m128i acc = _mm_setzero_si128();
+  __m128i acc2 = _mm_setzero_si128();
+  __m128i acc3 = _mm_setzero_si128();
+  __m128i acc4 = _mm_setzero_si128();
+
+  for (i = 0; i < end; i += 16)
+  {
+    acc = _mm_add_epi32(acc, _mm_mullo_epi32(_mm_loadu_si128((__m128i *)(vec1 + i)),
+                                             _mm_loadu_si128((__m128i *)(vec2 + i))));
+    acc2 = _mm_add_epi32(acc2, _mm_mullo_epi32(_mm_loadu_si128((__m128i *)(vec1 + i + 4)),
+                                               _mm_loadu_si128((__m128i *)(vec2 + i + 4))));
+    acc3 = _mm_add_epi32(acc3, _mm_mullo_epi32(_mm_loadu_si128((__m128i *)(vec1 + i + 8)),
+                                               _mm_loadu_si128((__m128i *)(vec2 + i + 8))));
+    acc4 = _mm_add_epi32(acc4, _mm_mullo_epi32(_mm_loadu_si128((__m128i *)(vec1 + i + 12)),
+                                               _mm_loadu_si128((__m128i *)(vec2 + i + 12))));
+  }
+
+  // Reduce the accumulators once instead of on every iteration
+  acc = _mm_add_epi32(_mm_add_epi32(acc, acc2), _mm_add_epi32(acc3, acc4));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  int32_t result = _mm_cvtsi128_si32(acc);
+
+  for (; i < (int32_t)n; i++)
+  {
+    result += vec1[i] * vec2[i];
+  }
+
+  return result;
+}
 
-  int32_t *int_mul = (int32_t *)&mul;
-  int32_t *int_mul2 = (int32_t *)&mul2;
-  int32_t *int_mul3 = (int32_t *)&mul3;
-  int32_t *int_mul4 = (int32_t *)&mul4;
+// Computes the dot product of vec1 and vec2, both of size n, 8 lanes at a time
+__attribute__((target("avx2"))) static int32_t dot_avx2(uint32_t n, int32_t *vec1, int32_t *vec2)
+{
+  int32_t i;
+  int32_t end = (int32_t)n - 31;
+  __m256i tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7, tmp8;
+  __m256i acc = _mm256_setzero_si256();
+  __m256i acc2 = _mm256_setzero_si256();
+  __m256i acc3 = _mm256_setzero_si256();
+  __m256i acc4 = _mm256_setzero_si256();
 
   for (i = 0; i < end; i += 32)
   {
@@ -58,22 +192,20 @@ int32_t dot(uint32_t n, int32_t *vec1, int32_t *vec2)
     debug_printf("vec2:\n");
     debug_print_m(1, 8, vec2 + i);
 
-    mul = _mm256_mullo_epi32(tmp1, tmp2);
-    mul2 = _mm256_mullo_epi32(tmp3, tmp4);
-    mul3 = _mm256_mullo_epi32(tmp5, tmp6);
-    mul4 = _mm256_mullo_epi32(tmp7, tmp8);
-
-    result += int_mul[0] + int_mul[1] + int_mul[2] + int_mul[3] + int_mul[4] + int_mul[5] + int_mul[6] + int_mul[7] +
-              int_mul2[0] + int_mul2[1] + int_mul2[2] + int_mul2[3] + int_mul2[4] + int_mul2[5] + int_mul2[6] + int_mul2[7] +
-              int_mul3[0] + int_mul3[1] + int_mul3[2] + int_mul3[3] + int_mul3[4] + int_mul3[5] + int_mul3[6] + int_mul3[7] +
-              int_mul4[0] + int_mul4[1] + int_mul4[2] + int_mul4[3] + int_mul4[4] + int_mul4[5] + int_mul4[6] + int_mul4[7];
-
-    debug_printf("Calculate Element:\n%9d %9d %9d %9d %9d %9d %9d %9d \n",
-                 tmp_arr[0], tmp_arr[1], tmp_arr[2], tmp_arr[3], tmp_arr[4], tmp_arr[5], tmp_arr[6], tmp_arr[7]);
-    debug_printf("result:%d\n", result);
+    acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(tmp1, tmp2));
+    acc2 = _mm256_add_epi32(acc2, _mm256_mullo_epi32(tmp3, tmp4));
+    acc3 = _mm256_add_epi32(acc3, _mm256_mullo_epi32(tmp5, tmp6));
+    acc4 = _mm256_add_epi32(acc4, _mm256_mullo_epi32(tmp7, tmp8));
   }
 
-  for (; i < n; i++)
+  // Reduce the accumulators once instead of on every iteration
+  acc = _mm256_add_epi32(_mm256_add_epi32(acc, acc2), _mm256_add_epi32(acc3, acc4));
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+  int32_t result = _mm_cvtsi128_si32(half);
+
+  for (; i < (int32_t)n; i++)
   {
     result += vec1[i] * vec2[i];
 
@@ -86,120 +218,1767 @@ int32_t dot(uint32_t n, int32_t *vec1, int32_t *vec2)
   return result;
 }
 
-// Computes the convolution of two matrices
-int convolve(matrix_t *a_matrix, matrix_t *b_matrix, matrix_t **output_matrix)
+// Computes the dot product of vec1 and vec2, both of size n, 16 lanes at a time
+__attribute__((target("avx512f"))) static int32_t dot_avx512(uint32_t n, int32_t *vec1, int32_t *vec2)
 {
-  debug_printf("Matrix A:\n");
-  debug_print_m(a_matrix->rows, a_matrix->cols, a_matrix->data);
+  int32_t i;
+  int32_t end = (int32_t)n - 31;
+  __m512i acc = _mm512_setzero_si512();
+  __m512i acc2 = _mm512_setzero_si512();
 
-  // convolve matrix a and matrix b, and store the resulting matrix in
-  // Assign veriable
-  int32_t rows_a = a_matrix->rows;
-  int32_t cols_a = a_matrix->cols;
-  int32_t rows_b = b_matrix->rows;
-  int32_t cols_b = b_matrix->cols;
-  int32_t rows_output = rows_a - rows_b + 1;
-  int32_t cols_output = cols_a - cols_b + 1;
+  for (i = 0; i < end; i += 32)
+  {
+    acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(_mm512_loadu_si512(vec1 + i),
+                                                   _mm512_loadu_si512(vec2 + i)));
+    acc2 = _mm512_add_epi32(acc2, _mm512_mullo_epi32(_mm512_loadu_si512(vec1 + i + 16),
+                                                     _mm512_loadu_si512(vec2 + i + 16)));
+  }
+
+  // The remainder is handled with a masked load rather than a scalar loop
+  for (; i < (int32_t)n; i += 16)
+  {
+    __mmask16 mask = (int32_t)n - i >= 16 ? 0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+    acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(_mm512_maskz_loadu_epi32(mask, vec1 + i),
+                                                   _mm512_maskz_loadu_epi32(mask, vec2 + i)));
+  }
 
-  // Allocate memory for the output matrix
-  *output_matrix = malloc(sizeof(matrix_t));
-  (*output_matrix)->rows = rows_output;
-  (*output_matrix)->cols = cols_output;
-  (*output_matrix)->data = malloc(sizeof(int32_t) * rows_output * cols_output);
+  return _mm512_reduce_add_epi32(_mm512_add_epi32(acc, acc2));
+}
 
-  // Flip matrix b
-  int32_t *flipped_b = malloc(sizeof(int32_t) * rows_b * cols_b);
-  int32_t *origin_data = b_matrix->data;
-  for (int32_t i = 0; i < rows_b; i++)
+// Computes one output element at a time
+__attribute__((always_inline)) static inline void region_shape_scalar(const conv_args_t *args, int32_t row_begin,
+                                                                      int32_t row_end, int32_t col_begin,
+                                                                      int32_t col_end, int32_t rows_b,
+                                                                      int32_t cols_b)
+{
+  for (int32_t i = row_begin; i < row_end; i++)
   {
-    for (int32_t j = 0; j < cols_b; j++)
+    int32_t *output_row = &args->output[(size_t)i * args->cols_output];
+
+    for (int32_t j = col_begin; j < col_end; j++)
     {
-      flipped_b[i * cols_b + j] = origin_data[(rows_b - i - 1) * cols_b + (cols_b - j - 1)];
+      int32_t sum = 0;
+      int32_t *a_index = &args->a[(size_t)i * args->cols_a + j];
+      int32_t *flipped_b_index = args->flipped_b;
+
+      for (int32_t k = 0; k < rows_b; k++, a_index += args->cols_a, flipped_b_index += cols_b)
+      {
+        for (int32_t c = 0; c < cols_b; c++)
+        {
+          sum += a_index[c] * flipped_b_index[c];
+        }
+      }
+      output_row[j] = sum;
     }
   }
+}
 
-  debug_printf("Matrix B:\n");
-  debug_print_m(rows_b, cols_b, b_matrix->data);
-  debug_printf("Matrix Flipped:\n");
-  debug_print_m(rows_b, cols_b, flipped_b);
+// Microkernel: keeps `rows` x (4 * `vectors`) outputs in registers and broadcasts each flipped_b
+// coefficient against the shifted A rows, so no horizontal sums are needed
+__attribute__((target("sse4.1"), always_inline)) static inline void block_sse41(const conv_args_t *args, int32_t i,
+                                                                                  int32_t j, int32_t rows,
+                                                                                  int32_t vectors, int32_t rows_b, int32_t cols_b)
+{
+  __m128i acc[BLOCK_ROWS][2];
+  int32_t *flipped_b_index = args->flipped_b;
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    acc[r][0] = _mm_setzero_si128();
+    acc[r][1] = _mm_setzero_si128();
+  }
+
+  for (int32_t k = 0; k < rows_b; k++)
+  {
+    int32_t *a_row = &args->a[(size_t)(i + k) * args->cols_a + j];
+
+    for (int32_t c = 0; c < cols_b; c++, flipped_b_index++)
+    {
+      __m128i coef = _mm_set1_epi32(*flipped_b_index);
+
+      for (int32_t r = 0; r < rows; r++)
+      {
+        int32_t *a_index = a_row + (size_t)r * args->cols_a + c;
+
+        acc[r][0] = _mm_add_epi32(acc[r][0], _mm_mullo_epi32(_mm_loadu_si128((__m128i *)a_index), coef));
+        if (vectors == 2)
+          acc[r][1] = _mm_add_epi32(acc[r][1], _mm_mullo_epi32(_mm_loadu_si128((__m128i *)(a_index + 4)), coef));
+      }
+    }
+  }
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    int32_t *output_index = &args->output[(size_t)(i + r) * args->cols_output + j];
+
+    _mm_storeu_si128((__m128i *)output_index, acc[r][0]);
+    if (vectors == 2)
+      _mm_storeu_si128((__m128i *)(output_index + 4), acc[r][1]);
+  }
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline void region_rows_sse41(const conv_args_t *args,
+                                                                                        int32_t i, int32_t rows,
+                                                                                        int32_t col_begin,
+                                                                                        int32_t col_end,
+                                                                                        int32_t rows_b,
+                                                                                        int32_t cols_b)
+{
+  int32_t j = col_begin;
+
+  for (; j + 8 <= col_end; j += 8)
+    block_sse41(args, i, j, rows, 2, rows_b, cols_b);
+  for (; j + 4 <= col_end; j += 4)
+    block_sse41(args, i, j, rows, 1, rows_b, cols_b);
+
+  // SSE has no masked loads, so the last few columns fall back to scalar code
+  if (j < col_end)
+    region_shape_scalar(args, i, i + rows, j, col_end, rows_b, cols_b);
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline void region_shape_sse41(const conv_args_t *args,
+                                                                              int32_t row_begin, int32_t row_end,
+                                                                              int32_t col_begin, int32_t col_end,
+                                                                              int32_t rows_b, int32_t cols_b)
+{
+  int32_t i = row_begin;
+
+  for (; i + BLOCK_ROWS <= row_end; i += BLOCK_ROWS)
+    region_rows_sse41(args, i, BLOCK_ROWS, col_begin, col_end, rows_b, cols_b);
+  for (; i < row_end; i++)
+    region_rows_sse41(args, i, 1, col_begin, col_end, rows_b, cols_b);
+}
+
+// Microkernel: keeps `rows` x (8 * `vectors`) outputs in registers; the last vector of a row may be
+// partial, in which case only the lanes set in `mask` are loaded and stored
+__attribute__((target("avx2"), always_inline)) static inline void block_avx2(const conv_args_t *args, int32_t i,
+                                                                               int32_t j, int32_t rows,
+                                                                               int32_t vectors, __m256i mask,
+                                                                               int32_t rows_b, int32_t cols_b)
+{
+  __m256i acc[BLOCK_ROWS][2];
+  int32_t *flipped_b_index = args->flipped_b;
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    acc[r][0] = _mm256_setzero_si256();
+    acc[r][1] = _mm256_setzero_si256();
+  }
+
+  for (int32_t k = 0; k < rows_b; k++)
+  {
+    int32_t *a_row = &args->a[(size_t)(i + k) * args->cols_a + j];
+
+    for (int32_t c = 0; c < cols_b; c++, flipped_b_index++)
+    {
+      __m256i coef = _mm256_set1_epi32(*flipped_b_index);
+
+      for (int32_t r = 0; r < rows; r++)
+      {
+        int32_t *a_index = a_row + (size_t)r * args->cols_a + c;
 
-#pragma omp parallel for
-  for (int32_t i = 0; i < rows_output; i++)
+        if (vectors == 2)
+        {
+          acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_mullo_epi32(_mm256_loadu_si256((__m256i *)a_index), coef));
+          acc[r][1] = _mm256_add_epi32(acc[r][1],
+                                       _mm256_mullo_epi32(_mm256_loadu_si256((__m256i *)(a_index + 8)), coef));
+        }
+        else
+        {
+          acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_mullo_epi32(_mm256_maskload_epi32(a_index, mask), coef));
+        }
+      }
+    }
+  }
+
+  for (int32_t r = 0; r < rows; r++)
   {
-    int32_t tail_point = cols_output - cols_output % 8;
-    __m256i temp;
-    int32_t *sum = (int32_t *)&temp;
+    int32_t *output_index = &args->output[(size_t)(i + r) * args->cols_output + j];
 
-    for (int32_t j = 0; j < tail_point; j += 8)
+    if (vectors == 2)
     {
-      temp = _mm256_set1_epi32(0);
+      _mm256_storeu_si256((__m256i *)output_index, acc[r][0]);
+      _mm256_storeu_si256((__m256i *)(output_index + 8), acc[r][1]);
+    }
+    else
+    {
+      _mm256_maskstore_epi32(output_index, mask, acc[r][0]);
+    }
+  }
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void region_rows_avx2(const conv_args_t *args, int32_t i,
+                                                                                     int32_t rows, int32_t col_begin,
+                                                                                     int32_t col_end, int32_t rows_b,
+                                                                                     int32_t cols_b)
+{
+  __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  int32_t j = col_begin;
+
+  for (; j + 16 <= col_end; j += 16)
+    block_avx2(args, i, j, rows, 2, lane_index, rows_b, cols_b);
+  for (; j < col_end; j += 8)
+    block_avx2(args, i, j, rows, 1, _mm256_cmpgt_epi32(_mm256_set1_epi32(col_end - j), lane_index), rows_b,
+               cols_b);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void region_shape_avx2(const conv_args_t *args,
+                                                                              int32_t row_begin, int32_t row_end,
+                                                                              int32_t col_begin, int32_t col_end,
+                                                                              int32_t rows_b, int32_t cols_b)
+{
+  int32_t i = row_begin;
+
+  for (; i + BLOCK_ROWS <= row_end; i += BLOCK_ROWS)
+    region_rows_avx2(args, i, BLOCK_ROWS, col_begin, col_end, rows_b, cols_b);
+  for (; i < row_end; i++)
+    region_rows_avx2(args, i, 1, col_begin, col_end, rows_b, cols_b);
+}
+
+// Microkernel: keeps `rows` x (16 * `vectors`) outputs in registers; the last vector of a row may be
+// partial, in which case only the lanes set in `mask` are loaded and stored
+__attribute__((target("avx512f"), always_inline)) static inline void block_avx512(const conv_args_t *args, int32_t i,
+                                                                                    int32_t j, int32_t rows,
+                                                                                    int32_t vectors, __mmask16 mask,
+                                                                                    int32_t rows_b, int32_t cols_b)
+{
+  __m512i acc[BLOCK_ROWS][2];
+  int32_t *flipped_b_index = args->flipped_b;
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    acc[r][0] = _mm512_setzero_si512();
+    acc[r][1] = _mm512_setzero_si512();
+  }
+
+  for (int32_t k = 0; k < rows_b; k++)
+  {
+    int32_t *a_row = &args->a[(size_t)(i + k) * args->cols_a + j];
 
-      int32_t *a_index = &a_matrix->data[i * cols_a + j];
-      int32_t *flipped_b_index = flipped_b;
+    for (int32_t c = 0; c < cols_b; c++, flipped_b_index++)
+    {
+      __m512i coef = _mm512_set1_epi32(*flipped_b_index);
 
-      for (int32_t k = 0; k < rows_b;
-           k++, a_index += cols_a, flipped_b_index += cols_b)
+      for (int32_t r = 0; r < rows; r++)
       {
-        debug_printf("Row %d Col %d :\n", k, j);
-        debug_print_m(1, cols_b, arr_A);
-
-        sum[0] += dot(cols_b, a_index, flipped_b_index);
-        sum[1] += dot(cols_b, a_index + 1, flipped_b_index);
-        sum[2] += dot(cols_b, a_index + 2, flipped_b_index);
-        sum[3] += dot(cols_b, a_index + 3, flipped_b_index);
-        sum[4] += dot(cols_b, a_index + 4, flipped_b_index);
-        sum[5] += dot(cols_b, a_index + 5, flipped_b_index);
-        sum[6] += dot(cols_b, a_index + 6, flipped_b_index);
-        sum[7] += dot(cols_b, a_index + 7, flipped_b_index);
+        int32_t *a_index = a_row + (size_t)r * args->cols_a + c;
+
+        if (vectors == 2)
+        {
+          acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_mullo_epi32(_mm512_loadu_si512(a_index), coef));
+          acc[r][1] = _mm512_add_epi32(acc[r][1], _mm512_mullo_epi32(_mm512_loadu_si512(a_index + 16), coef));
+        }
+        else
+        {
+          acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_mullo_epi32(_mm512_maskz_loadu_epi32(mask, a_index), coef));
+        }
       }
+    }
+  }
+
+  for (int32_t r = 0; r < rows; r++)
+  {
+    int32_t *output_index = &args->output[(size_t)(i + r) * args->cols_output + j];
+
+    if (vectors == 2)
+    {
+      _mm512_storeu_si512(output_index, acc[r][0]);
+      _mm512_storeu_si512(output_index + 16, acc[r][1]);
+    }
+    else
+    {
+      _mm512_mask_storeu_epi32(output_index, mask, acc[r][0]);
+    }
+  }
+}
+
+__attribute__((target("avx512f"), always_inline)) static inline void region_rows_avx512(const conv_args_t *args,
+                                                                                          int32_t i, int32_t rows,
+                                                                                          int32_t col_begin,
+                                                                                          int32_t col_end,
+                                                                                          int32_t rows_b,
+                                                                                          int32_t cols_b)
+{
+  int32_t j = col_begin;
+
+  for (; j + 32 <= col_end; j += 32)
+    block_avx512(args, i, j, rows, 2, 0xFFFF, rows_b, cols_b);
+  for (; j < col_end; j += 16)
+    block_avx512(args, i, j, rows, 1, col_end - j >= 16 ? 0xFFFF : (__mmask16)((1u << (col_end - j)) - 1), rows_b,
+                 cols_b);
+}
+
+__attribute__((target("avx512f"), always_inline)) static inline void region_shape_avx512(const conv_args_t *args,
+                                                                              int32_t row_begin, int32_t row_end,
+                                                                              int32_t col_begin, int32_t col_end,
+                                                                              int32_t rows_b, int32_t cols_b)
+{
+  int32_t i = row_begin;
+
+  for (; i + BLOCK_ROWS <= row_end; i += BLOCK_ROWS)
+    region_rows_avx512(args, i, BLOCK_ROWS, col_begin, col_end, rows_b, cols_b);
+  for (; i < row_end; i++)
+    region_rows_avx512(args, i, 1, col_begin, col_end, rows_b, cols_b);
+}
+
+// Instantiates the region kernels of one instruction set: the generic one, which reads the kernel
+// size at runtime, and one per common shape, in which the kernel loops have constant trip counts
+// and unroll completely. 1xN and Nx1 fix only the dimension that is 1.
+#define DEFINE_REGIONS(isa, attributes)                                                                       \
+  attributes static void region_##isa(const conv_args_t *args, int32_t row_begin, int32_t row_end,            \
+                                      int32_t col_begin, int32_t col_end)                                     \
+  {                                                                                                           \
+    region_shape_##isa(args, row_begin, row_end, col_begin, col_end, args->rows_b, args->cols_b);             \
+  }                                                                                                           \
+  attributes static void region_##isa##_3x3(const conv_args_t *args, int32_t row_begin, int32_t row_end,      \
+                                            int32_t col_begin, int32_t col_end)                               \
+  {                                                                                                           \
+    region_shape_##isa(args, row_begin, row_end, col_begin, col_end, 3, 3);                                   \
+  }                                                                                                           \
+  attributes static void region_##isa##_5x5(const conv_args_t *args, int32_t row_begin, int32_t row_end,      \
+                                            int32_t col_begin, int32_t col_end)                               \
+  {                                                                                                           \
+    region_shape_##isa(args, row_begin, row_end, col_begin, col_end, 5, 5);                                   \
+  }                                                                                                           \
+  attributes static void region_##isa##_7x7(const conv_args_t *args, int32_t row_begin, int32_t row_end,      \
+                                            int32_t col_begin, int32_t col_end)                               \
+  {                                                                                                           \
+    region_shape_##isa(args, row_begin, row_end, col_begin, col_end, 7, 7);                                   \
+  }                                                                                                           \
+  attributes static void region_##isa##_1xn(const conv_args_t *args, int32_t row_begin, int32_t row_end,      \
+                                            int32_t col_begin, int32_t col_end)                               \
+  {                                                                                                           \
+    region_shape_##isa(args, row_begin, row_end, col_begin, col_end, 1, args->cols_b);                        \
+  }                                                                                                           \
+  attributes static void region_##isa##_nx1(const conv_args_t *args, int32_t row_begin, int32_t row_end,      \
+                                            int32_t col_begin, int32_t col_end)                               \
+  {                                                                                                           \
+    region_shape_##isa(args, row_begin, row_end, col_begin, col_end, args->rows_b, 1);                        \
+  }
+
+DEFINE_REGIONS(scalar, )
+DEFINE_REGIONS(sse41, __attribute__((target("sse4.1"))))
+DEFINE_REGIONS(avx2, __attribute__((target("avx2"))))
+DEFINE_REGIONS(avx512, __attribute__((target("avx512f"))))
 
-      int32_t *output_index = &((*output_matrix)->data[i * cols_output + j]);
-      _mm256_storeu_si256((__m256i *)output_index, temp);
+#define SHAPE_REGIONS(isa) \
+  {region_##isa##_3x3, region_##isa##_5x5, region_##isa##_7x7, region_##isa##_1xn, region_##isa##_nx1}
+
+static const kernel_t kernels[ISA_COUNT] = {
+    [ISA_SCALAR] = {"scalar", 1, dot_scalar, region_scalar, SHAPE_REGIONS(scalar)},
+    [ISA_SSE41] = {"sse4.1", 4, dot_sse41, region_sse41, SHAPE_REGIONS(sse41)},
+    [ISA_AVX2] = {"avx2", 8, dot_avx2, region_avx2, SHAPE_REGIONS(avx2)},
+    [ISA_AVX512] = {"avx512", 16, dot_avx512, region_avx512, SHAPE_REGIONS(avx512)},
+};
+
+static const kernel_t *kernel;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+// Returns the most capable instruction set this CPU supports
+static isa_t detect_isa()
+{
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+    return ISA_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return ISA_AVX2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return ISA_SSE41;
+  return ISA_SCALAR;
+}
+
+// Picks the kernel family once per process, honoring the `isa` option
+static void select_kernel()
+{
+  isa_t supported = detect_isa();
+  isa_t isa = supported;
+  const char *forced = get_option("isa");
+
+  if (forced != NULL)
+  {
+    for (isa = 0; isa < ISA_COUNT; isa++)
+    {
+      if (strcmp(forced, kernels[isa].name) == 0)
+        break;
+    }
+
+    if (isa == ISA_COUNT)
+    {
+      fprintf(stderr, "Warning: unknown isa '%s', using %s\n", forced, kernels[supported].name);
+      isa = supported;
+    }
+    else if (isa > supported)
+    {
+      fprintf(stderr, "Warning: isa '%s' is not supported by this CPU, using %s\n", forced,
+              kernels[supported].name);
+      isa = supported;
     }
+  }
+
+  kernel = &kernels[isa];
+  debug_printf("Using %s kernels\n", kernel->name);
+}
+
+isa_t kernel_isa()
+{
+  pthread_once(&kernel_once, select_kernel);
+  return kernel - kernels;
+}
+
+// Returns the region kernel for the shape of args' kernel, preferring a compile-time sized one
+static region_fn region_for(const conv_args_t *args)
+{
+  shape_t shape = SHAPE_COUNT;
+
+  if (args->rows_b == 3 && args->cols_b == 3)
+    shape = SHAPE_3X3;
+  else if (args->rows_b == 5 && args->cols_b == 5)
+    shape = SHAPE_5X5;
+  else if (args->rows_b == 7 && args->cols_b == 7)
+    shape = SHAPE_7X7;
+  else if (args->rows_b == 1)
+    shape = SHAPE_1XN;
+  else if (args->cols_b == 1)
+    shape = SHAPE_NX1;
+
+  return shape == SHAPE_COUNT ? kernel->region : kernel->shapes[shape];
+}
+
+void convolve_region(const conv_args_t *args, int32_t row_begin, int32_t row_end, int32_t col_begin,
+                     int32_t col_end)
+{
+  region_for(args)(args, row_begin, row_end, col_begin, col_end);
+}
+
+// Returns the per-core L2 size in bytes, honoring the `l2-size` option
+static long l2_size()
+{
+  long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  return get_option_long("l2-size", size > 0 ? size : 1L << 20);
+}
+
+// Chooses 2D output tiles whose A window fits in L2, so short-wide and tall-narrow outputs both
+// split into enough independent work for every thread
+static void choose_tiles(const conv_args_t *args, int32_t *tile_rows_out, int32_t *tile_cols_out)
+{
+  int32_t threads = omp_get_max_threads();
+  long budget = l2_size() / TILE_L2_FRACTION / sizeof(int32_t);
+  int32_t tile_cols = args->cols_output < TILE_MAX_COLS ? args->cols_output : TILE_MAX_COLS;
+  int32_t tile_rows = BLOCK_ROWS;
+
+  // Grow the tile height while the A window (with its halo) and the output tile fit in L2
+  while (tile_rows < args->rows_output &&
+         (long)(tile_rows * 2 + args->rows_b - 1) * (tile_cols + args->cols_b - 1) + (long)tile_rows * 2 * tile_cols <=
+             budget)
+    tile_rows *= 2;
+
+  // Then shrink tiles until every thread has several to pick from
+  for (;;)
+  {
+    int64_t tiles = (int64_t)((args->rows_output + tile_rows - 1) / tile_rows) *
+                    ((args->cols_output + tile_cols - 1) / tile_cols);
+
+    if (tiles >= (int64_t)threads * TILES_PER_THREAD)
+      break;
+    if (tile_rows > BLOCK_ROWS)
+      tile_rows /= 2;
+    else if (tile_cols > TILE_MIN_COLS)
+      tile_cols = (tile_cols / 2 + TILE_MIN_COLS - 1) / TILE_MIN_COLS * TILE_MIN_COLS;
+    else
+      break;
+  }
+
+  debug_printf("Direct tiles: %d x %d\n", tile_rows, tile_cols);
+  *tile_rows_out = tile_rows;
+  *tile_cols_out = tile_cols;
+}
+
+// Computes the output tile by tile
+static void direct_convolve(const conv_args_t *args, region_fn kernel_region)
+{
+  int32_t tile_rows, tile_cols;
+
+  choose_tiles(args, &tile_rows, &tile_cols);
+
+  int32_t row_tiles = (args->rows_output + tile_rows - 1) / tile_rows;
+  int32_t col_tiles = (args->cols_output + tile_cols - 1) / tile_cols;
+
+  // Tiles are numbered row-major so threads working at the same time share A rows in L3
+#pragma omp parallel for schedule(dynamic)
+  for (int64_t tile = 0; tile < (int64_t)row_tiles * col_tiles; tile++)
+  {
+    int32_t row_begin = tile / col_tiles * tile_rows;
+    int32_t col_begin = tile % col_tiles * tile_cols;
+    int32_t row_end = row_begin + tile_rows < args->rows_output ? row_begin + tile_rows : args->rows_output;
+    int32_t col_end = col_begin + tile_cols < args->cols_output ? col_begin + tile_cols : args->cols_output;
 
-    for (int j = tail_point; j < cols_output; j += 1)
+    kernel_region(args, row_begin, row_end, col_begin, col_end);
+  }
+}
+
+// Computes the output on the 16-bit path in the tiles of direct_convolve(). Each tile's A window is
+// paired into a per-thread buffer the size of one window just before it is convolved, so the pairs
+// stay in L2, A is read once, and no A-sized copy is made. A tile whose window holds a value out of
+// 16-bit range runs on the 32-bit kernel instead.
+static void narrow_convolve(const conv_args_t *args, int32_t *paired_b, region_fn kernel_region)
+{
+  int32_t tile_rows, tile_cols;
+
+  choose_tiles(args, &tile_rows, &tile_cols);
+
+  int32_t row_tiles = (args->rows_output + tile_rows - 1) / tile_rows;
+  int32_t col_tiles = (args->cols_output + tile_cols - 1) / tile_cols;
+
+#pragma omp parallel
+  {
+    int32_t *pairs = malloc(sizeof(int32_t) * (tile_rows + args->rows_b - 1) * (tile_cols + args->cols_b - 1));
+
+#pragma omp for schedule(dynamic)
+    for (int64_t tile = 0; tile < (int64_t)row_tiles * col_tiles; tile++)
     {
-      int sum = 0;
-      int32_t *a_index = &a_matrix->data[i * cols_a + j];
-      int32_t *flipped_b_index = flipped_b;
+      int32_t row_begin = tile / col_tiles * tile_rows;
+      int32_t col_begin = tile % col_tiles * tile_cols;
+      int32_t row_end = row_begin + tile_rows < args->rows_output ? row_begin + tile_rows : args->rows_output;
+      int32_t col_end = col_begin + tile_cols < args->cols_output ? col_begin + tile_cols : args->cols_output;
+      int32_t window_rows = row_end - row_begin + args->rows_b - 1;
+      int32_t window_cols = col_end - col_begin + args->cols_b - 1;
 
-      for (int32_t k = 0; k < rows_b; k++, a_index += cols_a, flipped_b_index += cols_b)
+      if (narrow_pair_rows(&args->a[(size_t)row_begin * args->cols_a + col_begin], window_rows, window_cols,
+                           args->cols_a, pairs))
       {
-        debug_printf("Row %d Col %d :\n", k, j);
-        debug_print_m(1, cols_b, arr_A);
+        // The tile's outputs, computed from the window as if it were the whole of A
+        conv_args_t tile_args = *args;
 
-        sum += dot(cols_b, a_index, flipped_b_index);
+        tile_args.a = pairs;
+        tile_args.cols_a = window_cols;
+        tile_args.flipped_b = paired_b;
+        tile_args.output = &args->output[(size_t)row_begin * args->cols_output + col_begin];
+        tile_args.rows_output = row_end - row_begin;
+        narrow_region(&tile_args, 0, row_end - row_begin, 0, col_end - col_begin);
+      }
+      else
+      {
+        kernel_region(args, row_begin, row_end, col_begin, col_end);
       }
-      (*output_matrix)->data[i * cols_output + j] = sum;
     }
+
+    free(pairs);
   }
+}
+
+// Chooses the engine for a kernel from its size, its number of nonzero coefficients and whether it
+// factors into a column and a row, honoring the `engine` option. Limits that depend on A are applied
+// per call by engine_for().
+static engine_t choose_engine(int32_t rows_b, int32_t cols_b, int64_t nonzeros, bool separable)
+{
+  const char *forced = get_option("engine");
+  int64_t kernel_size = (int64_t)rows_b * cols_b;
+  int64_t ntt_threshold = get_option_long("ntt-threshold", NTT_MIN_KERNEL_SIZE);
+  engine_t engine = ENGINE_DIRECT;
 
-  free(flipped_b);
+  // A sparse pass costs about two multiply-adds of the other engines, since it goes through L1
+  bool sparse = kernel_size >= SPARSE_MIN_KERNEL_SIZE &&
+                nonzeros * 100 <= kernel_size * get_option_long("sparse-density", SPARSE_MAX_DENSITY) &&
+                2 * nonzeros < ntt_threshold;
 
-  return 0;
+  // Two 1D passes also move an intermediate through memory, so they only pay off once they save
+  // at least half of the multiplies (5x5 and up, but not 3x3); a kernel with very few nonzeros
+  // is cheaper still as sparse passes
+  if (separable && kernel_size > 2 * (rows_b + cols_b) && !(sparse && 2 * nonzeros <= rows_b + cols_b))
+    engine = ENGINE_SEPARABLE;
+  else if (sparse)
+    engine = ENGINE_SPARSE;
+  else if (kernel_size >= ntt_threshold)
+    engine = ENGINE_NTT;
+  else if (kernel_size >= get_option_long("gemm-threshold", GEMM_MIN_KERNEL_SIZE) && rows_b >= GEMM_MIN_KERNEL_ROWS)
+    engine = ENGINE_GEMM;
+
+  if (forced != NULL)
+  {
+    for (engine = 0; engine < ENGINE_COUNT; engine++)
+    {
+      if (strcmp(forced, engine_names[engine]) == 0)
+        break;
+    }
+
+    if (engine == ENGINE_COUNT)
+      engine = ENGINE_DIRECT;
+  }
+
+  if (engine == ENGINE_SEPARABLE && (!separable || rows_b == 1 || cols_b == 1))
+    engine = ENGINE_DIRECT;
+
+  // The GEMM inner kernel needs at least AVX2
+  if (engine == ENGINE_GEMM && kernel_isa() < ISA_AVX2)
+    engine = ENGINE_DIRECT;
+
+  return engine;
 }
 
-// Executes a task
-int execute_task(task_t *task)
+// Computes the dot product of vec1 and vec2, both of size n
+int32_t dot(uint32_t n, int32_t *vec1, int32_t *vec2)
 {
-  matrix_t *a_matrix, *b_matrix, *output_matrix;
+  pthread_once(&kernel_once, select_kernel);
+  return kernel->dot(n, vec1, vec2);
+}
 
-  if (read_matrix(get_a_matrix_path(task), &a_matrix))
-    return -1;
-  if (read_matrix(get_b_matrix_path(task), &b_matrix))
-    return -1;
+// Largest number of plans kept for reuse by later tasks (see the `plan-cache` option)
+#define DEFAULT_PLAN_CACHE 32
 
-  if (convolve(a_matrix, b_matrix, &output_matrix))
-    return -1;
+// A kernel flipped, analyzed and packed once, ready to be applied to any A. Plans are built by
+// plan_kernel() and cached by kernel contents, so tasks that repeat a kernel skip all of this.
+typedef struct plan
+{
+  uint64_t hash;
+  int32_t rows_b;
+  int32_t cols_b;
+  // 64-byte aligned, like a mapped payload
+  int32_t *flipped_b;
+  // Exact factors of flipped_b when it is rank-1
+  bool separable;
+  int32_t *column;
+  int32_t *row;
+  // Engine chosen from the kernel alone, and the operands it reads
+  engine_t engine;
+  region_fn region;
+  int32_t *packed_b;
+  sparse_entry_t *entries;
+  int32_t num_entries;
+  // Kernel column pairs for the 16-bit path, when every coefficient fits in 16 bits
+  int32_t *paired_b;
+  // One reference per user, plus one while the plan is in the cache
+  int refs;
+  struct plan *next;
+} plan_t;
 
-  if (write_matrix(get_output_matrix_path(task), output_matrix))
-    return -1;
+// Cached plans, most recently used first
+static plan_t *plans;
+static pthread_mutex_t plans_lock = PTHREAD_MUTEX_INITIALIZER;
 
-  free(a_matrix->data);
-  free(b_matrix->data);
-  free(output_matrix->data);
-  free(a_matrix);
-  free(b_matrix);
-  free(output_matrix);
-  return 0;
+// FNV-1a over the kernel's shape and contents
+static uint64_t hash_kernel(matrix_t *b_matrix)
+{
+  const uint8_t *bytes = (const uint8_t *)b_matrix->data;
+  size_t length = sizeof(int32_t) * b_matrix->rows * b_matrix->cols;
+  uint64_t hash = 14695981039346656037ULL ^ ((uint64_t)b_matrix->rows << 32 | b_matrix->cols);
+
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+
+  return hash;
+}
+
+// Returns true if plan was built from exactly the kernel in b_matrix
+static bool plan_matches(const plan_t *plan, uint64_t hash, matrix_t *b_matrix)
+{
+  size_t size = (size_t)b_matrix->rows * b_matrix->cols;
+
+  if (plan->hash != hash || plan->rows_b != (int32_t)b_matrix->rows || plan->cols_b != (int32_t)b_matrix->cols)
+    return false;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    if (plan->flipped_b[size - 1 - i] != b_matrix->data[i])
+      return false;
+  }
+
+  return true;
+}
+
+static void free_plan(plan_t *plan)
+{
+  free(plan->flipped_b);
+  free(plan->column);
+  free(plan->row);
+  free(plan->packed_b);
+  free(plan->entries);
+  free(plan->paired_b);
+  free(plan);
+}
+
+// Flips matrix b, factors it and chooses its engine
+static plan_t *build_plan(matrix_t *b_matrix, uint64_t hash)
+{
+  int32_t rows_b = b_matrix->rows;
+  int32_t cols_b = b_matrix->cols;
+  plan_t *plan = calloc(1, sizeof(plan_t));
+  int64_t trace_start = trace_begin();
+
+  plan->hash = hash;
+  plan->rows_b = rows_b;
+  plan->cols_b = cols_b;
+
+  // Flip matrix b
+  int32_t *flipped_b = aligned_alloc(64, (sizeof(int32_t) * rows_b * cols_b + 63) / 64 * 64);
+  int32_t *origin_data = b_matrix->data;
+  for (int32_t i = 0; i < rows_b; i++)
+  {
+    for (int32_t j = 0; j < cols_b; j++)
+    {
+      flipped_b[i * cols_b + j] = origin_data[(rows_b - i - 1) * cols_b + (cols_b - j - 1)];
+    }
+  }
+  plan->flipped_b = flipped_b;
+
+  debug_printf("Matrix B:\n");
+  debug_print_m(rows_b, cols_b, b_matrix->data);
+  debug_printf("Matrix Flipped:\n");
+  debug_print_m(rows_b, cols_b, flipped_b);
+
+  plan->column = malloc(sizeof(int32_t) * rows_b);
+  plan->row = malloc(sizeof(int32_t) * cols_b);
+  plan->separable = separable_factor(flipped_b, rows_b, cols_b, plan->column, plan->row);
+
+  int64_t nonzeros = 0;
+  for (int64_t i = 0; i < (int64_t)rows_b * cols_b; i++)
+    nonzeros += flipped_b[i] != 0;
+
+  conv_args_t shape = {.rows_b = rows_b, .cols_b = cols_b};
+  plan->engine = choose_engine(rows_b, cols_b, nonzeros, plan->separable);
+  plan->region = region_for(&shape);
+
+  if (plan->engine == ENGINE_SPARSE)
+    plan->num_entries = sparse_pack_kernel(flipped_b, rows_b, cols_b, &plan->entries);
+
+  // A direct kernel whose coefficients fit in 16 bits takes the 16-bit path whenever A fits too
+  if ((plan->engine == ENGINE_DIRECT || plan->engine == ENGINE_NARROW) && kernel_isa() >= ISA_AVX2 &&
+      (int64_t)rows_b * cols_b >= NARROW_MIN_KERNEL_SIZE && get_option_long("narrow", 1))
+    plan->paired_b = narrow_pack_kernel(flipped_b, rows_b, cols_b);
+  if (plan->engine == ENGINE_NARROW)
+    plan->engine = ENGINE_DIRECT;
+
+  // The NTT hands some shapes of A over to GEMM, so its kernels are packed for GEMM as well
+  if (plan->engine == ENGINE_GEMM || (plan->engine == ENGINE_NTT && kernel_isa() >= ISA_AVX2))
+    plan->packed_b = gemm_pack_kernel(flipped_b, rows_b, cols_b);
+
+  debug_printf("Planned %s engine\n", engine_names[plan->engine]);
+  trace_end("plan", NULL, trace_start);
+  return plan;
+}
+
+// Returns the plan for matrix b, reusing a cached one when the same kernel was planned before.
+// The caller releases it with release_plan().
+static plan_t *plan_kernel(matrix_t *b_matrix)
+{
+  long capacity = get_option_long("plan-cache", DEFAULT_PLAN_CACHE);
+  uint64_t hash = hash_kernel(b_matrix);
+
+  pthread_once(&kernel_once, select_kernel);
+
+  pthread_mutex_lock(&plans_lock);
+  for (plan_t **link = &plans; *link != NULL; link = &(*link)->next)
+  {
+    plan_t *plan = *link;
+
+    if (plan_matches(plan, hash, b_matrix))
+    {
+      // Move to the front
+      *link = plan->next;
+      plan->next = plans;
+      plans = plan;
+      plan->refs++;
+      pthread_mutex_unlock(&plans_lock);
+      return plan;
+    }
+  }
+  pthread_mutex_unlock(&plans_lock);
+
+  plan_t *plan = build_plan(b_matrix, hash);
+  plan->refs = 1;
+  if (capacity <= 0)
+    return plan;
+
+  pthread_mutex_lock(&plans_lock);
+  plan->refs++;
+  plan->next = plans;
+  plans = plan;
+
+  // Drop the cache's reference to the least recently used plans
+  plan_t **link = &plans;
+  for (long i = 0; i < capacity && *link != NULL; i++)
+    link = &(*link)->next;
+  while (*link != NULL)
+  {
+    plan_t *evicted = *link;
+
+    *link = evicted->next;
+    if (--evicted->refs == 0)
+      free_plan(evicted);
+  }
+  pthread_mutex_unlock(&plans_lock);
+
+  return plan;
+}
+
+static void release_plan(plan_t *plan)
+{
+  pthread_mutex_lock(&plans_lock);
+  bool unused = --plan->refs == 0;
+  pthread_mutex_unlock(&plans_lock);
+
+  if (unused)
+    free_plan(plan);
+}
+
+// Fills in the operands for applying a plan to a_matrix
+static conv_args_t plan_args(plan_t *plan, matrix_t *a_matrix, matrix_t *output_matrix)
+{
+  conv_args_t args = {a_matrix->data, a_matrix->cols, plan->flipped_b, plan->rows_b, plan->cols_b,
+                      output_matrix->data, output_matrix->rows, output_matrix->cols};
+  return args;
+}
+
+// Returns the engine a plan runs on for the A in args; `ntt` false rules the NTT out, for callers
+// whose memory budget cannot hold its transforms
+static engine_t engine_for(plan_t *plan, const conv_args_t *args, bool ntt)
+{
+  engine_t engine = plan->engine;
+  int32_t rows_a = args->rows_output + args->rows_b - 1;
+
+  // The NTT needs one output row plus its halo to fit in a transform
+  if (engine == ENGINE_NTT && (!ntt || !ntt_supported(rows_a, args->cols_a, args->rows_b, args->cols_b)))
+    engine = plan->packed_b != NULL ? ENGINE_GEMM : ENGINE_DIRECT;
+
+  if (engine == ENGINE_DIRECT && plan->paired_b != NULL)
+    engine = ENGINE_NARROW;
+
+  debug_printf("Using %s engine\n", engine_names[engine]);
+  return engine;
+}
+
+// Returns the bytes an engine allocates while it runs on the A in args (see kernels.h)
+static size_t engine_scratch_size(engine_t engine, const conv_args_t *args)
+{
+  int32_t tile_rows, tile_cols;
+
+  switch (engine)
+  {
+  case ENGINE_SEPARABLE:
+    return separable_scratch_size(args);
+
+  case ENGINE_NARROW:
+    // One paired A window per thread
+    choose_tiles(args, &tile_rows, &tile_cols);
+    return sizeof(int32_t) * (tile_rows + args->rows_b - 1) * (tile_cols + args->cols_b - 1) * omp_get_max_threads();
+
+  case ENGINE_NTT:
+    return ntt_scratch_size(args);
+
+  case ENGINE_GEMM:
+    return gemm_scratch_size(args);
+
+  default:
+    return 0;
+  }
+}
+
+// Runs one engine on a plan
+static void run_engine(engine_t engine, plan_t *plan, const conv_args_t *args)
+{
+  switch (engine)
+  {
+  case ENGINE_SEPARABLE:
+    separable_convolve(args, plan->column, plan->row);
+    break;
+
+  case ENGINE_SPARSE:
+    sparse_convolve(args, plan->entries, plan->num_entries, kernel_isa());
+    break;
+
+  case ENGINE_NARROW:
+    narrow_convolve(args, plan->paired_b, plan->region);
+    break;
+
+  case ENGINE_NTT:
+    ntt_convolve(args);
+    break;
+
+  case ENGINE_GEMM:
+    gemm_convolve(args, plan->packed_b, kernel_isa());
+    break;
+
+  default:
+    direct_convolve(args, plan->region);
+    break;
+  }
+}
+
+// Applies a plan to a_matrix, writing into an output matrix whose size is already set
+static void execute_plan(plan_t *plan, matrix_t *a_matrix, matrix_t *output_matrix)
+{
+  conv_args_t args = plan_args(plan, a_matrix, output_matrix);
+
+  debug_printf("Matrix A:\n");
+  debug_print_m(a_matrix->rows, a_matrix->cols, a_matrix->data);
+
+  run_engine(engine_for(plan, &args, true), plan, &args);
+}
+
+// Computes the convolution of two matrices into an output matrix whose size is already set
+static int convolve_into(matrix_t *a_matrix, matrix_t *b_matrix, matrix_t *output_matrix)
+{
+  plan_t *plan = plan_kernel(b_matrix);
+
+  execute_plan(plan, a_matrix, output_matrix);
+  release_plan(plan);
+  return 0;
+}
+
+// Applies several kernels to one A. Kernels on the direct engine share a single pass over A: each
+// A tile is loaded once and every kernel computes its outputs for that tile while it is in cache.
+// Kernels that are better served by another engine run on it separately.
+static void convolve_batch(matrix_t *a_matrix, plan_t **plans, matrix_t **output_matrices, int count)
+{
+  conv_args_t *args = malloc(sizeof(conv_args_t) * count);
+  region_fn *regions = malloc(sizeof(region_fn) * count);
+  int num_direct = 0;
+
+  for (int i = 0; i < count; i++)
+  {
+    conv_args_t kernel_args = plan_args(plans[i], a_matrix, output_matrices[i]);
+    engine_t engine = engine_for(plans[i], &kernel_args, true);
+
+    if (engine != ENGINE_DIRECT)
+    {
+      run_engine(engine, plans[i], &kernel_args);
+      continue;
+    }
+
+    args[num_direct] = kernel_args;
+    regions[num_direct] = plans[i]->region;
+    num_direct++;
+  }
+
+  int32_t row_tiles = (a_matrix->rows + BATCH_TILE_ROWS - 1) / BATCH_TILE_ROWS;
+  int32_t col_tiles = (a_matrix->cols + BATCH_TILE_COLS - 1) / BATCH_TILE_COLS;
+
+#pragma omp parallel for schedule(dynamic)
+  for (int64_t tile = 0; tile < (int64_t)row_tiles * col_tiles; tile++)
+  {
+    int32_t row_begin = tile / col_tiles * BATCH_TILE_ROWS;
+    int32_t col_begin = tile % col_tiles * BATCH_TILE_COLS;
+
+    for (int d = 0; d < num_direct; d++)
+    {
+      // Each kernel's output is smaller than A by its own size, so tiles are clipped per kernel
+      int32_t row_end = row_begin + BATCH_TILE_ROWS < args[d].rows_output ? row_begin + BATCH_TILE_ROWS
+                                                                           : args[d].rows_output;
+      int32_t col_end = col_begin + BATCH_TILE_COLS < args[d].cols_output ? col_begin + BATCH_TILE_COLS
+                                                                           : args[d].cols_output;
+
+      if (row_begin < row_end && col_begin < col_end)
+        regions[d](&args[d], row_begin, row_end, col_begin, col_end);
+    }
+  }
+
+  free(args);
+  free(regions);
+}
+
+// Computes the convolution of two matrices
+int convolve(matrix_t *a_matrix, matrix_t *b_matrix, matrix_t **output_matrix)
+{
+  int32_t rows_output = a_matrix->rows - b_matrix->rows + 1;
+  int32_t cols_output = a_matrix->cols - b_matrix->cols + 1;
+
+  // Allocate memory for the output matrix, reusing a buffer released by an earlier task
+  *output_matrix = pool_matrix(rows_output, cols_output);
+  if (*output_matrix == NULL)
+    return -1;
+
+  return convolve_into(a_matrix, b_matrix, *output_matrix);
+}
+
+// Computes a strided, dilated or multi-channel convolution into an output matrix whose size is
+// already set, on the strided form of the sparse engine: only the kept outputs are computed, and
+// only from the nonzero coefficients, at their dilated positions. A filter's kernels for all
+// channels become one kernel whose entries reach into each channel's rows of A, so the sum over
+// channels stays in registers, and all filters are applied in one pass over A
+static int convolve_params_into(matrix_t *a_matrix, matrix_t *b_matrix, const conv_params_t *params,
+                                 matrix_t *output_matrix)
+{
+  int32_t rows_channel = a_matrix->rows / params->channels;
+  int32_t rows_b = b_matrix->rows / params->channels / params->filters;
+  int32_t cols_b = b_matrix->cols;
+  sparse_entry_t *entries = malloc(sizeof(sparse_entry_t) * b_matrix->rows * cols_b);
+  int32_t *num_entries = malloc(sizeof(int32_t) * params->filters);
+  int32_t total = 0;
+
+  for (int32_t m = 0; m < params->filters; m++)
+  {
+    int32_t first = total;
+
+    for (int32_t ch = 0; ch < params->channels; ch++)
+    {
+      int32_t *kernel = &b_matrix->data[(size_t)(m * params->channels + ch) * rows_b * cols_b];
+
+      for (int32_t k = 0; k < rows_b; k++)
+      {
+        for (int32_t c = 0; c < cols_b; c++)
+        {
+          int32_t value = kernel[(rows_b - 1 - k) * cols_b + (cols_b - 1 - c)];
+
+          if (value != 0)
+            entries[total++] = (sparse_entry_t){ch * rows_channel + k * params->dilation_rows,
+                                                c * params->dilation_cols, value};
+        }
+      }
+    }
+    num_entries[m] = total - first;
+  }
+
+  conv_args_t args = {.a = a_matrix->data,
+                      .cols_a = a_matrix->cols,
+                      .output = output_matrix->data,
+                      .rows_output = output_matrix->rows / params->filters,
+                      .cols_output = output_matrix->cols};
+  sparse_convolve_strided(&args, entries, num_entries, params->filters, params->stride_rows, params->stride_cols,
+                          kernel_isa());
+
+  free(entries);
+  free(num_entries);
+  return 0;
+}
+
+int convolve_params(matrix_t *a_matrix, matrix_t *b_matrix, const conv_params_t *params, matrix_t **output_matrix)
+{
+  int32_t rows_output, cols_output;
+
+  if (!params_output_size(params, a_matrix->rows, a_matrix->cols, b_matrix->rows, b_matrix->cols, &rows_output,
+                           &cols_output))
+  {
+    fprintf(stderr, "Error: A and B do not match the convolution params\n");
+    return -1;
+  }
+
+  *output_matrix = pool_matrix(rows_output, cols_output);
+  if (*output_matrix == NULL)
+    return -1;
+
+  return convolve_params_into(a_matrix, b_matrix, params, *output_matrix);
+}
+
+// Returns true if a task whose A matrix is at a_path should write its output in the mapped format
+static bool mapped_output(char *a_path)
+{
+  const char *format = get_option("matrix-format");
+
+  if (format != NULL && strcmp(format, "mapped") == 0)
+    return true;
+  if (format != NULL && strcmp(format, "legacy") == 0)
+    return false;
+
+  // By default the output follows the format of A
+  return is_mapped_matrix(a_path);
+}
+
+// Returns the memory budget for one task in bytes, honoring the `memory-budget` option
+static long memory_budget()
+{
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  // Default to half of physical memory
+  return get_option_long("memory-budget", pages > 0 && page_size > 0 ? pages / 2 * page_size : 1L << 30);
+}
+
+// Allocates a 64-byte aligned buffer of exactly `count` elements outside the matrix pool, for
+// buffers counted against a memory budget: the pool would round them up to a size class and keep
+// them after the task
+static int32_t *budget_alloc(size_t count)
+{
+  return aligned_alloc(64, (sizeof(int32_t) * count + 63) / 64 * 64);
+}
+
+// Returns the bytes of a streamed band of `rows` output rows: its A rows and halo, its output rows
+// unless the output is already in memory, and what the engine allocates while it runs
+static size_t band_footprint(plan_t *plan, engine_t engine, int32_t rows, int32_t cols_a, int32_t cols_output,
+                             bool in_memory)
+{
+  conv_args_t args = {.cols_a = cols_a, .rows_b = plan->rows_b, .cols_b = plan->cols_b, .rows_output = rows,
+                      .cols_output = cols_output};
+  size_t band = (size_t)(rows + plan->rows_b - 1) * cols_a + (in_memory ? 0 : (size_t)rows * cols_output);
+
+  return sizeof(int32_t) * band + engine_scratch_size(engine, &args);
+}
+
+// Convolves output rows [row_begin, row_end) of a mapped A without loading it, reading A in bands
+// of output rows plus a (rows_b - 1)-row halo. Each output band is written to the output stream as
+// soon as it is done, or straight into `output` (the rows from row_begin on) when it is not NULL.
+// Bands are as tall as the budget allows once it holds the A band, the output band and the
+// engine's scratch for it, so the budget bounds the peak memory whatever the size of A.
+static int stream_convolve(int a_fd, matrix_header_t *a_header, matrix_t *b_matrix, int output_fd,
+                           matrix_header_t *output_header, int32_t *output, int32_t row_begin, int32_t row_end,
+                           long budget)
+{
+  int32_t cols_a = a_header->cols;
+  int32_t halo = b_matrix->rows - 1;
+  int32_t cols_output = a_header->cols - b_matrix->cols + 1;
+  plan_t *plan = plan_kernel(b_matrix);
+  conv_args_t shape = {.cols_a = cols_a, .rows_b = plan->rows_b, .cols_b = plan->cols_b,
+                       .rows_output = row_end - row_begin, .cols_output = cols_output};
+
+  // The NTT's transforms do not shrink with the band, so it gives way when they alone do not fit
+  engine_t engine = engine_for(plan, &shape, true);
+  if (engine == ENGINE_NTT && band_footprint(plan, engine, 1, cols_a, cols_output, output != NULL) > (size_t)budget)
+    engine = engine_for(plan, &shape, false);
+
+  // Every engine's footprint grows with the band, so the tallest band that fits is found by bisection
+  int32_t band_rows = 0;
+  for (int32_t low = 1, high = row_end - row_begin; low <= high;)
+  {
+    int32_t rows = low + (high - low) / 2;
+
+    if (band_footprint(plan, engine, rows, cols_a, cols_output, output != NULL) <= (size_t)budget)
+      band_rows = rows, low = rows + 1;
+    else
+      high = rows - 1;
+  }
+
+  if (band_rows < 1)
+  {
+    fprintf(stderr, "Error: memory budget of %ld bytes cannot hold one output row and its halo\n", budget);
+    release_plan(plan);
+    return -1;
+  }
+  debug_printf("Streaming bands of %d rows\n", band_rows);
+
+  int32_t *a_band = budget_alloc((size_t)(band_rows + halo) * cols_a);
+  int32_t *output_band = output != NULL ? NULL : budget_alloc((size_t)band_rows * cols_output);
+  int result = a_band != NULL && (output != NULL || output_band != NULL) ? 0 : -1;
+
+  if (result)
+    fprintf(stderr, "Error: cannot allocate a band of %d rows\n", band_rows);
+  if (result == 0)
+    result = read_matrix_rows(a_fd, a_header, row_begin, halo, a_band);
+
+  for (int32_t band_begin = row_begin; band_begin < row_end && result == 0; band_begin += band_rows)
+  {
+    int32_t rows = row_end - band_begin < band_rows ? row_end - band_begin : band_rows;
+    int32_t *band_output = output != NULL ? &output[(size_t)(band_begin - row_begin) * cols_output] : output_band;
+    matrix_t a_matrix = {rows + halo, cols_a, a_band};
+    matrix_t output_matrix = {rows, cols_output, band_output};
+
+    // The halo rows are already at the front of the buffer, so only the new rows are read
+    int64_t trace_start = trace_begin();
+    result = read_matrix_rows(a_fd, a_header, band_begin + halo, rows, &a_band[(size_t)halo * cols_a]);
+    trace_end("read", NULL, trace_start);
+    if (result == 0)
+    {
+      conv_args_t args = plan_args(plan, &a_matrix, &output_matrix);
+
+      trace_start = trace_begin();
+      run_engine(engine, plan, &args);
+      trace_end("convolve", NULL, trace_start);
+    }
+    if (result == 0 && output == NULL)
+    {
+      trace_start = trace_begin();
+      result = write_matrix_rows(output_fd, output_header, band_begin, rows, output_band);
+      trace_end("write", NULL, trace_start);
+    }
+
+    memmove(a_band, &a_band[(size_t)rows * cols_a], sizeof(int32_t) * halo * cols_a);
+  }
+
+  release_plan(plan);
+  free(a_band);
+  free(output_band);
+  return result;
+}
+
+// Executes a task with params. A is always loaded whole, since the stride makes its output bands and
+// their halos irregular to stream.
+static int run_params_task(task_t *task, const conv_params_t *params)
+{
+  matrix_t *a_matrix = NULL, *b_matrix = NULL, *output_matrix = NULL;
+  char *a_path = get_a_matrix_path(task);
+  char *b_path = get_b_matrix_path(task);
+  char *output_path = get_output_matrix_path(task);
+  int32_t rows_output, cols_output;
+
+  int64_t trace_start = trace_begin();
+  int result = load_cached_matrix(b_path, &b_matrix) || load_cached_matrix(a_path, &a_matrix) ? -1 : 0;
+  trace_end("read", task->path, trace_start);
+
+  if (result == 0 && !params_output_size(params, a_matrix->rows, a_matrix->cols, b_matrix->rows, b_matrix->cols,
+                                          &rows_output, &cols_output))
+  {
+    fprintf(stderr, "Error: A and B of %s do not match its convolution params\n", task->path);
+    result = -1;
+  }
+
+  // A mapped output is written in place, like in run_task()
+  bool mapped = mapped_output(a_path);
+  if (result == 0 && mapped)
+    result = create_mapped_matrix(output_path, rows_output, cols_output, &output_matrix);
+  else if (result == 0 && (output_matrix = pool_matrix(rows_output, cols_output)) == NULL)
+    result = -1;
+
+  if (result == 0)
+  {
+    trace_start = trace_begin();
+    result = convolve_params_into(a_matrix, b_matrix, params, output_matrix);
+    trace_end("convolve", task->path, trace_start);
+  }
+
+  if (result == 0 && !mapped)
+  {
+    trace_start = trace_begin();
+    result = write_matrix(output_path, output_matrix);
+    trace_end("write", task->path, trace_start);
+  }
+
+  if (a_matrix != NULL)
+    release_matrix(a_matrix);
+  if (b_matrix != NULL)
+    release_matrix(b_matrix);
+  if (output_matrix != NULL)
+    release_matrix(output_matrix);
+  free(a_path);
+  free(b_path);
+  free(output_path);
+  return result;
+}
+
+// Streams a task whose A is mapped and which, with its output, does not fit in the memory budget;
+// sets `streamed` if it did, and otherwise leaves the task to be run from a loaded A
+static int stream_task(task_t *task, char *a_path, char *output_path, matrix_t *b_matrix, bool *streamed)
+{
+  matrix_header_t a_header;
+  int a_fd = is_mapped_matrix(a_path) ? open_matrix_stream(a_path, &a_header) : -1;
+  long budget = memory_budget();
+  int result = 0;
+
+  *streamed = false;
+  if (a_fd < 0)
+    return 0;
+
+  uint64_t rows_output = a_header.rows - b_matrix->rows + 1;
+  uint64_t cols_output = a_header.cols - b_matrix->cols + 1;
+  uint64_t output_size = sizeof(int32_t) * rows_output * cols_output;
+  uint64_t size = sizeof(int32_t) * (uint64_t)a_header.rows * a_header.cols + output_size;
+
+  if (size > (uint64_t)budget && mapped_output(a_path))
+  {
+    matrix_header_t output_header;
+    int output_fd = create_matrix_stream(output_path, rows_output, cols_output, &output_header);
+    result = output_fd < 0 ? -1
+                           : stream_convolve(a_fd, &a_header, b_matrix, output_fd, &output_header, NULL, 0,
+                                             rows_output, budget);
+
+    if (output_fd >= 0)
+      close(output_fd);
+    *streamed = true;
+  }
+  else if (size > (uint64_t)budget)
+  {
+    // A legacy output can only be written whole, so it is kept in memory while A streams through
+    // the rest of the budget
+    matrix_t output = {rows_output, cols_output, NULL};
+
+    result = -1;
+    if (output_size < (uint64_t)budget)
+      output.data = budget_alloc(rows_output * cols_output);
+    if (output.data == NULL)
+      fprintf(stderr, "Error: memory budget of %ld bytes cannot hold the output of %s\n", budget, task->path);
+    else
+      result = stream_convolve(a_fd, &a_header, b_matrix, -1, NULL, output.data, 0, rows_output,
+                               budget - output_size);
+    if (result == 0)
+    {
+      int64_t trace_start = trace_begin();
+      result = write_matrix(output_path, &output);
+      trace_end("write", task->path, trace_start);
+    }
+
+    free(output.data);
+    *streamed = true;
+  }
+
+  close(a_fd);
+  return result;
+}
+
+// Executes a task
+static int run_task(task_t *task)
+{
+  conv_params_t params;
+
+  if (read_task_params(task, &params))
+    return -1;
+  if (!dense_params(&params))
+    return run_params_task(task, &params);
+
+  matrix_t *a_matrix = NULL, *b_matrix = NULL, *output_matrix = NULL;
+  char *a_path = get_a_matrix_path(task);
+  char *b_path = get_b_matrix_path(task);
+  char *output_path = get_output_matrix_path(task);
+  bool streamed = false;
+
+  int64_t trace_start = trace_begin();
+  int result = load_cached_matrix(b_path, &b_matrix);
+  trace_end("read", task->path, trace_start);
+
+  // A mapped A whose input and output do not fit in the budget is streamed instead of loaded
+  if (result == 0)
+    result = stream_task(task, a_path, output_path, b_matrix, &streamed);
+
+  if (result == 0 && !streamed)
+  {
+    trace_start = trace_begin();
+    result = load_cached_matrix(a_path, &a_matrix);
+    trace_end("read", task->path, trace_start);
+  }
+
+  // A mapped output file is created up front and the convolution writes straight into it
+  bool mapped = mapped_output(a_path);
+  if (result == 0 && !streamed && mapped)
+  {
+    result = create_mapped_matrix(output_path, a_matrix->rows - b_matrix->rows + 1,
+                                  a_matrix->cols - b_matrix->cols + 1, &output_matrix);
+  }
+
+  if (result == 0 && !streamed)
+  {
+    trace_start = trace_begin();
+    result = mapped ? convolve_into(a_matrix, b_matrix, output_matrix) : convolve(a_matrix, b_matrix, &output_matrix);
+    trace_end("convolve", task->path, trace_start);
+  }
+
+  if (result == 0 && !streamed && !mapped)
+  {
+    trace_start = trace_begin();
+    result = write_matrix(output_path, output_matrix);
+    trace_end("write", task->path, trace_start);
+  }
+
+  if (a_matrix != NULL)
+    release_matrix(a_matrix);
+  if (b_matrix != NULL)
+    release_matrix(b_matrix);
+  if (output_matrix != NULL)
+    release_matrix(output_matrix);
+  free(a_path);
+  free(b_path);
+  free(output_path);
+  return result;
+}
+
+int execute_task(task_t *task)
+{
+  int64_t trace_start = trace_begin();
+  int result = run_task(task);
+
+  trace_end("task", task->path, trace_start);
+  return result;
+}
+
+// A batch of tasks sharing one A, carried through the load, compute and store stages
+typedef struct
+{
+  task_t **tasks;
+  int num_tasks;
+  bool mapped;
+  // Set when the batch does not fit in its budget or holds a task with params; its tasks then run one
+  // by one in the compute stage, which lets execute_task() stream or stride the ones that need it
+  bool unstaged;
+  matrix_t *a_matrix;
+  matrix_t **b_matrices;
+  matrix_t **output_matrices;
+  int result;
+  // Position of the task the last step ran on, which is the task that failed once result is nonzero
+  int failed;
+} staged_batch_t;
+
+// Releases the inputs loaded for a batch
+static void release_inputs(staged_batch_t *batch)
+{
+  if (batch->a_matrix != NULL)
+    release_matrix(batch->a_matrix);
+  for (int i = 0; i < batch->num_tasks; i++)
+  {
+    if (batch->b_matrices[i] != NULL)
+      release_matrix(batch->b_matrices[i]);
+  }
+
+  batch->a_matrix = NULL;
+  memset(batch->b_matrices, 0, sizeof(matrix_t *) * batch->num_tasks);
+}
+
+// Load stage: reads the inputs of a batch and creates its outputs, if A and every output fit in
+// `budget` bytes
+static void load_batch(staged_batch_t *batch, long budget)
+{
+  char *a_path = get_a_matrix_path(batch->tasks[0]);
+  int num_tasks = batch->num_tasks;
+  int64_t trace_start = trace_begin();
+
+  batch->mapped = mapped_output(a_path);
+  batch->b_matrices = calloc(num_tasks, sizeof(matrix_t *));
+  batch->output_matrices = calloc(num_tasks, sizeof(matrix_t *));
+
+  // Strided tasks compute their outputs their own way, so a batch holding one runs task by task
+  for (int i = 0; i < num_tasks && batch->result == 0 && !batch->unstaged; i++)
+  {
+    conv_params_t params;
+    batch->result = read_task_params(batch->tasks[i], &params);
+    batch->unstaged = batch->result == 0 && !dense_params(&params);
+    batch->failed = i;
+  }
+  if (batch->result != 0 || batch->unstaged)
+  {
+    free(a_path);
+    trace_end("read", batch->tasks[0]->path, trace_start);
+    return;
+  }
+
+  for (int i = 0; i < num_tasks && batch->result == 0; i++)
+  {
+    char *b_path = get_b_matrix_path(batch->tasks[i]);
+    batch->result = load_cached_matrix(b_path, &batch->b_matrices[i]);
+    batch->failed = i;
+    free(b_path);
+  }
+
+  // The size of a mapped A is known from its header, so an oversized one is never loaded
+  matrix_header_t a_header;
+  int a_fd = batch->result == 0 && is_mapped_matrix(a_path) ? open_matrix_stream(a_path, &a_header) : -1;
+  if (a_fd >= 0)
+    close(a_fd);
+  else if (batch->result == 0 && load_cached_matrix(a_path, &batch->a_matrix) == 0)
+    a_header = (matrix_header_t){.rows = batch->a_matrix->rows, .cols = batch->a_matrix->cols};
+  else if (batch->result == 0)
+  {
+    batch->result = -1;
+    batch->failed = 0;
+  }
+
+  // a_header is only filled in when every input was read
+  if (batch->result != 0)
+  {
+    free(a_path);
+    trace_end("read", batch->tasks[0]->path, trace_start);
+    return;
+  }
+
+  // Every output of the batch is alive at once
+  uint64_t size = sizeof(int32_t) * (uint64_t)a_header.rows * a_header.cols;
+  for (int i = 0; i < num_tasks; i++)
+  {
+    size += sizeof(int32_t) * (uint64_t)(a_header.rows - batch->b_matrices[i]->rows + 1) *
+            (a_header.cols - batch->b_matrices[i]->cols + 1);
+  }
+
+  if (size > (uint64_t)budget)
+  {
+    release_inputs(batch);
+    batch->unstaged = true;
+    free(a_path);
+    trace_end("read", batch->tasks[0]->path, trace_start);
+    return;
+  }
+
+  if (batch->a_matrix == NULL && load_cached_matrix(a_path, &batch->a_matrix))
+  {
+    batch->result = -1;
+    batch->failed = 0;
+  }
+  free(a_path);
+
+  for (int i = 0; i < num_tasks && batch->result == 0; i++)
+  {
+    int32_t rows_output = batch->a_matrix->rows - batch->b_matrices[i]->rows + 1;
+    int32_t cols_output = batch->a_matrix->cols - batch->b_matrices[i]->cols + 1;
+
+    batch->failed = i;
+
+    if (batch->mapped)
+    {
+      char *output_path = get_output_matrix_path(batch->tasks[i]);
+      batch->result = create_mapped_matrix(output_path, rows_output, cols_output, &batch->output_matrices[i]);
+      free(output_path);
+    }
+    else
+    {
+      batch->output_matrices[i] = pool_matrix(rows_output, cols_output);
+      batch->result = batch->output_matrices[i] == NULL ? -1 : 0;
+    }
+  }
+  trace_end("read", batch->tasks[0]->path, trace_start);
+}
+
+// Compute stage: applies every kernel of a loaded batch together with convolve_batch()
+static void compute_batch(staged_batch_t *batch)
+{
+  if (batch->result != 0)
+    return;
+
+  if (batch->unstaged)
+  {
+    for (int i = 0; i < batch->num_tasks && batch->result == 0; i++)
+    {
+      batch->result = execute_task(batch->tasks[i]);
+      batch->failed = i;
+    }
+    return;
+  }
+
+  int64_t trace_start = trace_begin();
+  plan_t **kernel_plans = malloc(sizeof(plan_t *) * batch->num_tasks);
+  for (int i = 0; i < batch->num_tasks; i++)
+    kernel_plans[i] = plan_kernel(batch->b_matrices[i]);
+
+  convolve_batch(batch->a_matrix, kernel_plans, batch->output_matrices, batch->num_tasks);
+  trace_end("convolve", batch->tasks[0]->path, trace_start);
+
+  for (int i = 0; i < batch->num_tasks; i++)
+    release_plan(kernel_plans[i]);
+  free(kernel_plans);
+}
+
+// Store stage: writes the outputs that are not mapped and releases everything the batch holds
+static int store_batch(staged_batch_t *batch)
+{
+  int64_t trace_start = trace_begin();
+
+  for (int i = 0; i < batch->num_tasks && batch->output_matrices[i] != NULL; i++)
+  {
+    if (!batch->mapped && batch->result == 0)
+    {
+      char *output_path = get_output_matrix_path(batch->tasks[i]);
+      batch->result = write_matrix(output_path, batch->output_matrices[i]);
+      batch->failed = i;
+      free(output_path);
+    }
+    release_matrix(batch->output_matrices[i]);
+  }
+  trace_end("write", batch->tasks[0]->path, trace_start);
+
+  release_inputs(batch);
+  free(batch->b_matrices);
+  free(batch->output_matrices);
+  return batch->result;
+}
+
+// Runs the stages of one batch one after another
+static int run_batch(staged_batch_t *batch)
+{
+  load_batch(batch, memory_budget());
+  compute_batch(batch);
+  return store_batch(batch);
+}
+
+// Executes tasks that share one A matrix: A is loaded once and the kernels are applied together by
+// convolve_batch(). Batches whose A and outputs do not fit in the memory budget run task by task.
+int execute_task_batch(task_t **tasks, int num_tasks)
+{
+  staged_batch_t batch = {.tasks = tasks, .num_tasks = num_tasks};
+
+  return run_batch(&batch);
+}
+
+// Batches alive at once in execute_task_groups(): one storing, one computing and one loading
+#define PIPELINE_DEPTH 3
+
+typedef struct
+{
+  bool store;
+  int index;
+} io_job_t;
+
+// State shared by the compute thread and the I/O thread of execute_task_groups()
+typedef struct
+{
+  staged_batch_t *batches;
+  long budget;
+  // Queued I/O jobs, run in order
+  io_job_t jobs[2 * PIPELINE_DEPTH];
+  int head;
+  int tail;
+  bool *loaded;
+  bool done;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} pipeline_t;
+
+static void push_job(pipeline_t *pipeline, bool store, int index)
+{
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->jobs[pipeline->tail % (2 * PIPELINE_DEPTH)] = (io_job_t){store, index};
+  pipeline->tail++;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+// Runs load and store jobs in the order they were queued until the pipeline is done
+static void *run_io(void *arg)
+{
+  pipeline_t *pipeline = arg;
+
+  // Loads and stores overlap compute only if they are free to run on another CPU
+  unpin_thread();
+  pthread_mutex_lock(&pipeline->lock);
+  for (;;)
+  {
+    while (pipeline->head == pipeline->tail && !pipeline->done)
+      pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    if (pipeline->head == pipeline->tail)
+      break;
+
+    io_job_t job = pipeline->jobs[pipeline->head % (2 * PIPELINE_DEPTH)];
+    pipeline->head++;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    staged_batch_t *batch = &pipeline->batches[job.index];
+    int result = 0;
+    if (job.store)
+      result = store_batch(batch);
+    else
+      load_batch(batch, pipeline->budget);
+
+    pthread_mutex_lock(&pipeline->lock);
+    if (job.store && result != 0 && (pipeline->failed < 0 || job.index < pipeline->failed))
+      pipeline->failed = job.index;
+    if (!job.store)
+      pipeline->loaded[job.index] = true;
+    pthread_cond_broadcast(&pipeline->cond);
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return NULL;
+}
+
+int execute_task_groups(task_group_t **groups, int num_groups, task_t **failed)
+{
+  if (num_groups == 0)
+    return 0;
+  if (num_groups == 1)
+  {
+    staged_batch_t batch = {.tasks = groups[0]->tasks, .num_tasks = groups[0]->num_tasks};
+
+    if (run_batch(&batch) == 0)
+      return 0;
+    *failed = batch.tasks[batch.failed];
+    return -1;
+  }
+
+  // Each batch in flight gets an equal share of the memory budget; larger ones run unstaged
+  pipeline_t pipeline = {.batches = calloc(num_groups, sizeof(staged_batch_t)),
+                         .budget = memory_budget() / PIPELINE_DEPTH};
+  pipeline.loaded = calloc(num_groups, sizeof(bool));
+  pipeline.failed = -1;
+  pthread_mutex_init(&pipeline.lock, NULL);
+  pthread_cond_init(&pipeline.cond, NULL);
+
+  for (int g = 0; g < num_groups; g++)
+  {
+    pipeline.batches[g].tasks = groups[g]->tasks;
+    pipeline.batches[g].num_tasks = groups[g]->num_tasks;
+  }
+
+  pthread_t io_thread;
+  pthread_create(&io_thread, NULL, run_io, &pipeline);
+
+  // The I/O thread loads one batch ahead and stores one behind the batch being computed. Jobs run
+  // in queue order, so the load of batch g + 1 follows the store of batch g - 1, and no more than
+  // PIPELINE_DEPTH batches (and 2 * PIPELINE_DEPTH queued jobs) are ever alive.
+  push_job(&pipeline, false, 0);
+  for (int g = 0; g < num_groups; g++)
+  {
+    staged_batch_t *batch = &pipeline.batches[g];
+
+    if (g + 1 < num_groups)
+      push_job(&pipeline, false, g + 1);
+
+    int64_t trace_start = trace_begin();
+    pthread_mutex_lock(&pipeline.lock);
+    while (!pipeline.loaded[g])
+      pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+    bool stop = pipeline.failed >= 0;
+    pthread_mutex_unlock(&pipeline.lock);
+    trace_end("io-wait", NULL, trace_start);
+
+    // After a failure the remaining batches are only loaded and released, never computed
+    if (stop && batch->result == 0)
+      batch->result = -1;
+    compute_batch(batch);
+    push_job(&pipeline, true, g);
+  }
+
+  pthread_mutex_lock(&pipeline.lock);
+  pipeline.done = true;
+  pthread_cond_broadcast(&pipeline.cond);
+  pthread_mutex_unlock(&pipeline.lock);
+  pthread_join(io_thread, NULL);
+
+  if (pipeline.failed >= 0)
+    *failed = pipeline.batches[pipeline.failed].tasks[pipeline.batches[pipeline.failed].failed];
+  pthread_mutex_destroy(&pipeline.lock);
+  pthread_cond_destroy(&pipeline.cond);
+  free(pipeline.batches);
+  free(pipeline.loaded);
+  return pipeline.failed < 0 ? 0 : -1;
+}
+
+// Executes one band of a split task
+static int run_task_band(task_t *task, int band, int num_bands)
+{
+  char *a_path = get_a_matrix_path(task);
+  matrix_header_t a_header;
+  conv_params_t params;
+  int a_fd = read_task_params(task, &params) == 0 && dense_params(&params) && mapped_output(a_path)
+                 ? open_matrix_stream(a_path, &a_header)
+                 : -1;
+  free(a_path);
+
+  // Rows can only be read from a mapped A and written to a mapped output, and tasks with params are
+  // not split; otherwise the first band runs the whole task
+  if (a_fd < 0)
+    return band == 0 ? execute_task(task) : 0;
+
+  char *b_path = get_b_matrix_path(task);
+  matrix_t *b_matrix;
+  int b_result = load_cached_matrix(b_path, &b_matrix);
+  free(b_path);
+  if (b_result)
+  {
+    close(a_fd);
+    return -1;
+  }
+
+  int32_t rows_output = a_header.rows - b_matrix->rows + 1;
+  int32_t cols_output = a_header.cols - b_matrix->cols + 1;
+  int32_t row_begin = (int64_t)rows_output * band / num_bands;
+  int32_t row_end = (int64_t)rows_output * (band + 1) / num_bands;
+
+  // Every band opens the same output without truncating it and writes only its own rows
+  char *output_path = get_output_matrix_path(task);
+  matrix_header_t output_header;
+  int output_fd = share_matrix_stream(output_path, rows_output, cols_output, &output_header);
+  int result = output_fd < 0 ? -1 : 0;
+  free(output_path);
+
+  if (result == 0 && row_begin < row_end)
+  {
+    result = stream_convolve(a_fd, &a_header, b_matrix, output_fd, &output_header, NULL, row_begin, row_end,
+                             memory_budget());
+  }
+
+  if (output_fd >= 0)
+    close(output_fd);
+  close(a_fd);
+  release_matrix(b_matrix);
+  return result;
+}
+
+int execute_task_band(task_t *task, int band, int num_bands)
+{
+  int64_t trace_start = trace_begin();
+  int result = run_task_band(task, band, num_bands);
+
+  trace_end("band", task->path, trace_start);
+  return result;
 }
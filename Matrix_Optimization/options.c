@@ -0,0 +1,79 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+#define OPTION_PREFIX "CONVOLVE_"
+
+// Builds the environment variable name for an option, e.g. "isa" -> "CONVOLVE_ISA"
+static void option_env_name(const char *name, size_t length, char *env_name, size_t size)
+{
+  size_t n = strlen(OPTION_PREFIX);
+  memcpy(env_name, OPTION_PREFIX, n);
+
+  for (size_t i = 0; i < length && n < size - 1; i++, n++)
+  {
+    env_name[n] = name[i] == '-' ? '_' : toupper((unsigned char)name[i]);
+  }
+  env_name[n] = '\0';
+}
+
+void parse_options(int *argc, char *argv[])
+{
+  int kept = 1;
+
+  for (int i = 1; i < *argc; i++)
+  {
+    char *equals = strchr(argv[i], '=');
+
+    if (strncmp(argv[i], "--", 2) != 0 || equals == NULL)
+    {
+      argv[kept++] = argv[i];
+      continue;
+    }
+
+    char env_name[128];
+    option_env_name(argv[i] + 2, equals - argv[i] - 2, env_name, sizeof(env_name));
+    setenv(env_name, equals + 1, 1);
+  }
+
+  argv[kept] = NULL;
+  *argc = kept;
+}
+
+const char *get_option(const char *name)
+{
+  char env_name[128];
+  option_env_name(name, strlen(name), env_name, sizeof(env_name));
+
+  const char *value = getenv(env_name);
+  return (value != NULL && value[0] != '\0') ? value : NULL;
+}
+
+long get_option_long(const char *name, long default_value)
+{
+  const char *value = get_option(name);
+  if (value == NULL)
+    return default_value;
+
+  char *end;
+  long result = strtol(value, &end, 0);
+
+  // Accept the usual size suffixes so budgets can be written as 512M or 2G
+  switch (toupper((unsigned char)*end))
+  {
+  case 'K':
+    result <<= 10;
+    break;
+  case 'M':
+    result <<= 20;
+    break;
+  case 'G':
+    result <<= 30;
+    break;
+  }
+
+  return result;
+}
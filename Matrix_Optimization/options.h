@@ -0,0 +1,17 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// Runtime options shared by the coordinators and the compute engines.
+// Every option can be given on the command line as `--name=value` or in the
+// environment as `CONVOLVE_NAME=value`; the command line wins.
+
+// Strips `--name=value` arguments out of argv and exports them to the environment
+void parse_options(int *argc, char *argv[]);
+
+// Returns the value of an option, or NULL if it was not set
+const char *get_option(const char *name);
+
+// Returns the value of a numeric option, or `default_value` if it was not set
+long get_option_long(const char *name, long default_value);
+
+#endif
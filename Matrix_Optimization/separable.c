@@ -0,0 +1,141 @@
+#include <omp.h>
+
+#include "compute.h"
+#include "kernels.h"
+
+// Rank-1 kernels (box, binomial and other outer-product filters) are applied as a row pass with
+// `row` followed by a column pass with `column`. Both factors are exact integers and arithmetic
+// wraps modulo 2^32 either way, so the result is bit-identical to the 2D loop.
+
+// Output rows and columns per tile; the intermediate rows of one tile stay in L2
+#define SEPARABLE_TILE_ROWS 32
+#define SEPARABLE_TILE_COLS 512
+
+static int64_t gcd(int64_t a, int64_t b)
+{
+  a = a < 0 ? -a : a;
+  b = b < 0 ? -b : b;
+
+  while (b)
+  {
+    int64_t t = a % b;
+    a = b;
+    b = t;
+  }
+
+  return a;
+}
+
+bool separable_factor(const int32_t *kernel, int32_t rows, int32_t cols, int32_t *column, int32_t *row)
+{
+  int32_t pivot_row = -1;
+
+  for (int32_t i = 0; i < rows && pivot_row < 0; i++)
+  {
+    for (int32_t j = 0; j < cols; j++)
+    {
+      if (kernel[i * cols + j] != 0)
+      {
+        pivot_row = i;
+        break;
+      }
+    }
+  }
+
+  // An all-zero kernel is trivially separable
+  if (pivot_row < 0)
+  {
+    memset(column, 0, sizeof(int32_t) * rows);
+    memset(row, 0, sizeof(int32_t) * cols);
+    return true;
+  }
+
+  // `row` is the pivot row divided by its gcd, so every other row must be an integer multiple of it
+  const int32_t *pivot = &kernel[pivot_row * cols];
+  int64_t divisor = 0;
+  int32_t pivot_col = -1;
+
+  for (int32_t j = 0; j < cols; j++)
+  {
+    divisor = gcd(divisor, pivot[j]);
+    if (pivot_col < 0 && pivot[j] != 0)
+      pivot_col = j;
+  }
+  for (int32_t j = 0; j < cols; j++)
+  {
+    row[j] = pivot[j] / divisor;
+  }
+
+  for (int32_t i = 0; i < rows; i++)
+  {
+    const int32_t *kernel_row = &kernel[i * cols];
+
+    if ((int64_t)kernel_row[pivot_col] % row[pivot_col] != 0)
+      return false;
+    column[i] = (int64_t)kernel_row[pivot_col] / row[pivot_col];
+
+    for (int32_t j = 0; j < cols; j++)
+    {
+      if ((int64_t)column[i] * row[j] != kernel_row[j])
+        return false;
+    }
+  }
+
+  return true;
+}
+
+size_t separable_scratch_size(const conv_args_t *args)
+{
+  // One intermediate tile per thread
+  return sizeof(int32_t) * (SEPARABLE_TILE_ROWS + args->rows_b - 1) * SEPARABLE_TILE_COLS * omp_get_max_threads();
+}
+
+void separable_convolve(const conv_args_t *args, int32_t *column, int32_t *row)
+{
+  int32_t row_tiles = (args->rows_output + SEPARABLE_TILE_ROWS - 1) / SEPARABLE_TILE_ROWS;
+  int32_t col_tiles = (args->cols_output + SEPARABLE_TILE_COLS - 1) / SEPARABLE_TILE_COLS;
+  int32_t halo = args->rows_b - 1;
+
+#pragma omp parallel
+  {
+    int32_t *tmp = malloc(sizeof(int32_t) * (SEPARABLE_TILE_ROWS + halo) * SEPARABLE_TILE_COLS);
+
+#pragma omp for collapse(2) schedule(dynamic)
+    for (int32_t row_tile = 0; row_tile < row_tiles; row_tile++)
+    {
+      for (int32_t col_tile = 0; col_tile < col_tiles; col_tile++)
+      {
+        int32_t row_begin = row_tile * SEPARABLE_TILE_ROWS;
+        int32_t rows = args->rows_output - row_begin < SEPARABLE_TILE_ROWS ? args->rows_output - row_begin
+                                                                            : SEPARABLE_TILE_ROWS;
+        int32_t col_begin = col_tile * SEPARABLE_TILE_COLS;
+        int32_t cols = args->cols_output - col_begin < SEPARABLE_TILE_COLS ? args->cols_output - col_begin
+                                                                            : SEPARABLE_TILE_COLS;
+
+        // Row pass over the tile's A rows, halo included, into tmp
+        conv_args_t row_pass = {&args->a[(size_t)row_begin * args->cols_a + col_begin],
+                                args->cols_a,
+                                row,
+                                1,
+                                args->cols_b,
+                                tmp,
+                                rows + halo,
+                                cols};
+        convolve_region(&row_pass, 0, rows + halo, 0, cols);
+
+        // Column pass from tmp into the output tile
+        conv_args_t column_pass = {tmp,
+                                   cols,
+                                   column,
+                                   args->rows_b,
+                                   1,
+                                   &args->output[(size_t)row_begin * args->cols_output + col_begin],
+                                   rows,
+                                   args->cols_output};
+        convolve_region(&column_pass, 0, rows, 0, cols);
+      }
+    }
+
+    free(tmp);
+  }
+}
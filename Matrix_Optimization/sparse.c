@@ -0,0 +1,416 @@
+#include <omp.h>
+#include <x86intrin.h>
+
+#include "compute.h"
+#include "kernels.h"
+
+// Kernels that are mostly zeros (dilated, edge and mask kernels) are applied one nonzero
+// coefficient at a time: each coefficient adds a shifted copy of A, scaled by the coefficient, to
+// the output. The work is proportional to the number of nonzeros instead of the kernel size. The
+// output is processed in tiles small enough to stay in L1 across all the passes.
+
+// Output rows and columns per tile
+#define SPARSE_TILE_ROWS 8
+#define SPARSE_TILE_COLS 512
+// Narrowest tile of the strided engine, which divides the tile width by the column stride
+#define STRIDED_MIN_TILE_COLS 16
+// Most bytes of split A rows a strided tile keeps, and kernels that share one split of a tile
+#define STRIDED_SPLIT_BYTES (256 << 10)
+#define STRIDED_KERNEL_GROUP 16
+
+// Computes output[c] = a[c] * value (if `first`) or output[c] += a[c] * value for c in [0, n)
+typedef void (*axpy_fn)(int32_t *output, const int32_t *a, int32_t value, int32_t n, bool first);
+
+static void axpy_scalar(int32_t *output, const int32_t *a, int32_t value, int32_t n, bool first)
+{
+  for (int32_t c = 0; c < n; c++)
+    output[c] = first ? a[c] * value : output[c] + a[c] * value;
+}
+
+#define DEFINE_AXPY(isa, attributes, type, lanes, set1, loadu, storeu, mullo, add)                   \
+  attributes static void axpy_##isa(int32_t *output, const int32_t *a, int32_t value, int32_t n, bool first) \
+  {                                                                                                \
+    type coef = set1(value);                                                                       \
+    int32_t c = 0;                                                                                 \
+                                                                                                   \
+    for (; c + lanes <= n; c += lanes)                                                             \
+    {                                                                                              \
+      type product = mullo(loadu((const void *)&a[c]), coef);                                      \
+      storeu((void *)&output[c], first ? product : add(loadu((const void *)&output[c]), product)); \
+    }                                                                                              \
+    for (; c < n; c++)                                                                             \
+      output[c] = first ? a[c] * value : output[c] + a[c] * value;                                 \
+  }
+
+DEFINE_AXPY(sse41, __attribute__((target("sse4.1"))), __m128i, 4, _mm_set1_epi32, _mm_loadu_si128,
+            _mm_storeu_si128, _mm_mullo_epi32, _mm_add_epi32)
+DEFINE_AXPY(avx2, __attribute__((target("avx2"))), __m256i, 8, _mm256_set1_epi32, _mm256_loadu_si256,
+            _mm256_storeu_si256, _mm256_mullo_epi32, _mm256_add_epi32)
+DEFINE_AXPY(avx512, __attribute__((target("avx512f"))), __m512i, 16, _mm512_set1_epi32, _mm512_loadu_si512,
+            _mm512_storeu_si512, _mm512_mullo_epi32, _mm512_add_epi32)
+
+static const axpy_fn axpy_kernels[ISA_COUNT] = {axpy_scalar, axpy_sse41, axpy_avx2, axpy_avx512};
+
+int32_t sparse_pack_kernel(const int32_t *flipped_b, int32_t rows_b, int32_t cols_b, sparse_entry_t **entries)
+{
+  int32_t count = 0;
+
+  *entries = malloc(sizeof(sparse_entry_t) * ((int64_t)rows_b * cols_b > 0 ? (int64_t)rows_b * cols_b : 1));
+
+  // Row-major order, so consecutive passes read neighbouring rows of A
+  for (int32_t i = 0; i < rows_b; i++)
+  {
+    for (int32_t j = 0; j < cols_b; j++)
+    {
+      if (flipped_b[i * cols_b + j] != 0)
+        (*entries)[count++] = (sparse_entry_t){i, j, flipped_b[i * cols_b + j]};
+    }
+  }
+
+  return count;
+}
+
+void sparse_convolve(const conv_args_t *args, const sparse_entry_t *entries, int32_t num_entries, isa_t isa)
+{
+  axpy_fn axpy = axpy_kernels[isa];
+  int32_t row_tiles = (args->rows_output + SPARSE_TILE_ROWS - 1) / SPARSE_TILE_ROWS;
+  int32_t col_tiles = (args->cols_output + SPARSE_TILE_COLS - 1) / SPARSE_TILE_COLS;
+
+#pragma omp parallel for collapse(2) schedule(dynamic)
+  for (int32_t row_tile = 0; row_tile < row_tiles; row_tile++)
+  {
+    for (int32_t col_tile = 0; col_tile < col_tiles; col_tile++)
+    {
+      int32_t row_begin = row_tile * SPARSE_TILE_ROWS;
+      int32_t row_end = row_begin + SPARSE_TILE_ROWS < args->rows_output ? row_begin + SPARSE_TILE_ROWS
+                                                                          : args->rows_output;
+      int32_t col_begin = col_tile * SPARSE_TILE_COLS;
+      int32_t cols = args->cols_output - col_begin < SPARSE_TILE_COLS ? args->cols_output - col_begin
+                                                                       : SPARSE_TILE_COLS;
+
+      // An all-zero kernel still has to clear its output
+      if (num_entries == 0)
+      {
+        for (int32_t i = row_begin; i < row_end; i++)
+          memset(&args->output[(size_t)i * args->cols_output + col_begin], 0, sizeof(int32_t) * cols);
+        continue;
+      }
+
+      // The first pass writes the tile and the others accumulate into it
+      for (int32_t e = 0; e < num_entries; e++)
+      {
+        for (int32_t i = row_begin; i < row_end; i++)
+        {
+          axpy(&args->output[(size_t)i * args->cols_output + col_begin],
+               &args->a[(size_t)(i + entries[e].row) * args->cols_a + col_begin + entries[e].col], entries[e].value,
+               cols, e == 0);
+        }
+      }
+    }
+  }
+}
+
+// Strided and dilated convolutions compute only the outputs the stride keeps. Output row i reads
+// A row i * stride_rows + row for the entries of each kernel row; such a row is split into
+// stride_cols planes of every stride_cols-th column, so that what one output row reads from a
+// plane is contiguous again. Each output vector is summed over all the entries in registers and
+// stored once.
+
+// Computes output[c] = the sum of values[s] * sources[s][c] over the sources, for c in [0, n)
+typedef void (*weighted_sum_fn)(int32_t *output, const int32_t **sources, const int32_t *values, int32_t num_sources,
+                                int32_t n);
+
+static void weighted_sum_scalar(int32_t *output, const int32_t **sources, const int32_t *values, int32_t num_sources,
+                                int32_t n)
+{
+  for (int32_t c = 0; c < n; c++)
+  {
+    int32_t sum = 0;
+
+    for (int32_t s = 0; s < num_sources; s++)
+      sum += sources[s][c] * values[s];
+    output[c] = sum;
+  }
+}
+
+// Keeps four vectors of output in registers across all the sources, then one vector at a time
+#define DEFINE_WEIGHTED_SUM(isa, attributes, type, lanes, setzero, set1, loadu, storeu, mullo, add)             \
+  attributes static void weighted_sum_##isa(int32_t *output, const int32_t **sources, const int32_t *values,   \
+                                            int32_t num_sources, int32_t n)                                    \
+  {                                                                                                            \
+    int32_t c = 0;                                                                                             \
+                                                                                                               \
+    for (; c + 4 * lanes <= n; c += 4 * lanes)                                                                 \
+    {                                                                                                          \
+      type acc0 = setzero(), acc1 = setzero(), acc2 = setzero(), acc3 = setzero();                             \
+                                                                                                               \
+      for (int32_t s = 0; s < num_sources; s++)                                                                \
+      {                                                                                                        \
+        type coef = set1(values[s]);                                                                           \
+        const int32_t *source = sources[s] + c;                                                                \
+                                                                                                               \
+        acc0 = add(acc0, mullo(loadu((const void *)source), coef));                                            \
+        acc1 = add(acc1, mullo(loadu((const void *)(source + lanes)), coef));                                  \
+        acc2 = add(acc2, mullo(loadu((const void *)(source + 2 * lanes)), coef));                              \
+        acc3 = add(acc3, mullo(loadu((const void *)(source + 3 * lanes)), coef));                              \
+      }                                                                                                        \
+      storeu((void *)&output[c], acc0);                                                                        \
+      storeu((void *)&output[c + lanes], acc1);                                                                \
+      storeu((void *)&output[c + 2 * lanes], acc2);                                                            \
+      storeu((void *)&output[c + 3 * lanes], acc3);                                                            \
+    }                                                                                                          \
+    for (; c + lanes <= n; c += lanes)                                                                         \
+    {                                                                                                          \
+      type acc = setzero();                                                                                    \
+                                                                                                               \
+      for (int32_t s = 0; s < num_sources; s++)                                                                \
+        acc = add(acc, mullo(loadu((const void *)(sources[s] + c)), set1(values[s])));                         \
+      storeu((void *)&output[c], acc);                                                                         \
+    }                                                                                                          \
+    for (; c < n; c++)                                                                                         \
+    {                                                                                                          \
+      int32_t sum = 0;                                                                                         \
+                                                                                                               \
+      for (int32_t s = 0; s < num_sources; s++)                                                                \
+        sum += sources[s][c] * values[s];                                                                      \
+      output[c] = sum;                                                                                         \
+    }                                                                                                          \
+  }
+
+DEFINE_WEIGHTED_SUM(sse41, __attribute__((target("sse4.1"))), __m128i, 4, _mm_setzero_si128, _mm_set1_epi32,
+                    _mm_loadu_si128, _mm_storeu_si128, _mm_mullo_epi32, _mm_add_epi32)
+DEFINE_WEIGHTED_SUM(avx2, __attribute__((target("avx2"))), __m256i, 8, _mm256_setzero_si256, _mm256_set1_epi32,
+                    _mm256_loadu_si256, _mm256_storeu_si256, _mm256_mullo_epi32, _mm256_add_epi32)
+DEFINE_WEIGHTED_SUM(avx512, __attribute__((target("avx512f"))), __m512i, 16, _mm512_setzero_si512, _mm512_set1_epi32,
+                    _mm512_loadu_si512, _mm512_storeu_si512, _mm512_mullo_epi32, _mm512_add_epi32)
+
+static const weighted_sum_fn weighted_sum_kernels[ISA_COUNT] = {weighted_sum_scalar, weighted_sum_sse41,
+                                                                weighted_sum_avx2, weighted_sum_avx512};
+
+// Splits a row of A into `stride` planes `pitch` elements apart: planes[q * pitch + m] =
+// row[m * stride + q] for m in [0, count), as far as the first `length` elements of row reach
+typedef void (*split_fn)(const int32_t *row, int32_t length, int32_t stride, int32_t *planes, int32_t pitch,
+                         int32_t count);
+
+static void split_scalar(const int32_t *row, int32_t length, int32_t stride, int32_t *planes, int32_t pitch,
+                         int32_t count)
+{
+  int32_t groups = length / stride < count ? length / stride : count;
+
+  for (int32_t m = 0; m < groups; m++)
+  {
+    for (int32_t q = 0; q < stride; q++)
+      planes[q * pitch + m] = row[m * stride + q];
+  }
+
+  // A may end part way into the next group
+  for (int32_t q = 0; groups < count && groups * stride + q < length; q++)
+    planes[q * pitch + groups] = row[groups * stride + q];
+}
+
+// Vector splits fill `lanes` elements of plane q at a time from the `stride` vectors they span:
+// lane l takes element l * stride + q, which is lane (l * stride + q) % lanes of vector
+// (l * stride + q) / lanes, so every source vector is permuted into place and merged under a mask
+__attribute__((target("avx2"))) static void split_avx2(const int32_t *row, int32_t length, int32_t stride,
+                                                       int32_t *planes, int32_t pitch, int32_t count)
+{
+  int32_t groups = length / stride < count ? length / stride : count;
+  int32_t vector_groups = stride <= 8 ? groups / 8 * 8 : 0;
+
+  for (int32_t q = 0; q < stride && vector_groups > 0; q++)
+  {
+    __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                        _mm256_set1_epi32(stride)),
+                                     _mm256_set1_epi32(q));
+    __m256i source = _mm256_srli_epi32(index, 3);
+
+    for (int32_t m = 0; m < vector_groups; m += 8)
+    {
+      __m256i plane = _mm256_setzero_si256();
+
+      for (int32_t t = 0; t < stride; t++)
+      {
+        __m256i moved = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)&row[m * stride + 8 * t]),
+                                                    index);
+        plane = _mm256_blendv_epi8(plane, moved, _mm256_cmpeq_epi32(source, _mm256_set1_epi32(t)));
+      }
+      _mm256_storeu_si256((__m256i *)&planes[q * pitch + m], plane);
+    }
+  }
+
+  split_scalar(&row[vector_groups * stride], length - vector_groups * stride, stride, &planes[vector_groups], pitch,
+               count - vector_groups);
+}
+
+__attribute__((target("avx512f"))) static void split_avx512(const int32_t *row, int32_t length, int32_t stride,
+                                                            int32_t *planes, int32_t pitch, int32_t count)
+{
+  int32_t groups = length / stride < count ? length / stride : count;
+  int32_t vector_groups = stride <= 16 ? groups / 16 * 16 : 0;
+  __mmask16 masks[16];
+
+  for (int32_t q = 0; q < stride && vector_groups > 0; q++)
+  {
+    __m512i index = _mm512_add_epi32(
+        _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                           _mm512_set1_epi32(stride)),
+        _mm512_set1_epi32(q));
+
+    for (int32_t t = 0; t < stride; t++)
+      masks[t] = _mm512_cmpeq_epi32_mask(_mm512_srli_epi32(index, 4), _mm512_set1_epi32(t));
+
+    for (int32_t m = 0; m < vector_groups; m += 16)
+    {
+      __m512i plane = _mm512_setzero_si512();
+
+      for (int32_t t = 0; t < stride; t++)
+        plane = _mm512_mask_permutexvar_epi32(plane, masks[t], index, _mm512_loadu_si512(&row[m * stride + 16 * t]));
+      _mm512_storeu_si512(&planes[q * pitch + m], plane);
+    }
+  }
+
+  split_scalar(&row[vector_groups * stride], length - vector_groups * stride, stride, &planes[vector_groups], pitch,
+               count - vector_groups);
+}
+
+static const split_fn split_kernels[ISA_COUNT] = {split_scalar, split_scalar, split_avx2, split_avx512};
+
+static int compare_rows(const void *a, const void *b)
+{
+  return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+void sparse_convolve_strided(const conv_args_t *args, const sparse_entry_t *entries, const int32_t *num_entries,
+                             int32_t num_kernels, int32_t stride_rows, int32_t stride_cols, isa_t isa)
+{
+  weighted_sum_fn weighted_sum = weighted_sum_kernels[isa];
+  split_fn split_planes = split_kernels[isa];
+  int32_t tile_cols = SPARSE_TILE_COLS / stride_cols > STRIDED_MIN_TILE_COLS ? SPARSE_TILE_COLS / stride_cols
+                                                                              : STRIDED_MIN_TILE_COLS;
+  int32_t tile_rows = SPARSE_TILE_ROWS;
+  int32_t plane_cols = tile_cols;
+  int32_t total_entries = 0, most_entries = 0;
+
+  for (int32_t m = 0; m < num_kernels; m++)
+  {
+    total_entries += num_entries[m];
+    most_entries = num_entries[m] > most_entries ? num_entries[m] : most_entries;
+  }
+
+  // Entries that read the same row of A share it, split into planes once for all of them; `slots`
+  // numbers the distinct rows the kernels read, in increasing order
+  size_t list_size = sizeof(int32_t) * (total_entries > 0 ? total_entries : 1);
+  int32_t *values = malloc(list_size);
+  int32_t *slots = malloc(list_size);
+  int32_t *slot_rows = malloc(list_size);
+  int32_t num_slots = 0;
+
+  for (int32_t e = 0; e < total_entries; e++)
+  {
+    slot_rows[e] = entries[e].row;
+    values[e] = entries[e].value;
+    if (entries[e].col / stride_cols + tile_cols > plane_cols)
+      plane_cols = entries[e].col / stride_cols + tile_cols;
+  }
+  qsort(slot_rows, total_entries, sizeof(int32_t), compare_rows);
+  for (int32_t e = 0; e < total_entries; e++)
+  {
+    if (num_slots == 0 || slot_rows[num_slots - 1] != slot_rows[e])
+      slot_rows[num_slots++] = slot_rows[e];
+  }
+  for (int32_t e = 0; e < total_entries; e++)
+    slots[e] = (int32_t *)bsearch(&entries[e].row, slot_rows, num_slots, sizeof(int32_t), compare_rows) - slot_rows;
+
+  // Shorter tiles when many rows are read, so a tile's split rows stay in L2
+  size_t split_size = (size_t)stride_cols * plane_cols;
+  while (stride_cols > 1 && tile_rows > 1 && sizeof(int32_t) * tile_rows * num_slots * split_size > STRIDED_SPLIT_BYTES)
+    tile_rows /= 2;
+
+  // A rows a tile can read, from the first one under its first output row
+  int32_t window_rows = (tile_rows - 1) * stride_rows + (num_slots > 0 ? slot_rows[num_slots - 1] : 0) + 1;
+  int32_t row_tiles = (args->rows_output + tile_rows - 1) / tile_rows;
+  int32_t col_tiles = (args->cols_output + tile_cols - 1) / tile_cols;
+  int32_t kernel_groups = (num_kernels + STRIDED_KERNEL_GROUP - 1) / STRIDED_KERNEL_GROUP;
+  size_t output_size = (size_t)args->rows_output * args->cols_output;
+
+#pragma omp parallel
+  {
+    // The A rows read by a tile, each split into planes of every stride_cols-th column once and
+    // shared by all the output rows and kernels that read it; `split` maps a window row to its
+    // planes
+    int32_t *planes = malloc(sizeof(int32_t) * (stride_cols > 1 ? tile_rows * num_slots * split_size : 1));
+    int32_t *split = malloc(sizeof(int32_t) * window_rows);
+    const int32_t **rows = malloc(sizeof(int32_t *) * (num_slots > 0 ? num_slots : 1));
+    const int32_t **sources = malloc(sizeof(int32_t *) * (most_entries > 0 ? most_entries : 1));
+
+    // Tiles of different groups of kernels are independent too, so many kernels on a small A
+    // still give every thread work
+#pragma omp for collapse(3) schedule(dynamic)
+    for (int32_t group = 0; group < kernel_groups; group++)
+    {
+      for (int32_t row_tile = 0; row_tile < row_tiles; row_tile++)
+      {
+        for (int32_t col_tile = 0; col_tile < col_tiles; col_tile++)
+        {
+          int32_t row_begin = row_tile * tile_rows;
+          int32_t row_end = row_begin + tile_rows < args->rows_output ? row_begin + tile_rows : args->rows_output;
+          int32_t col_begin = col_tile * tile_cols;
+          int32_t cols = args->cols_output - col_begin < tile_cols ? args->cols_output - col_begin : tile_cols;
+          int32_t first_col = col_begin * stride_cols;
+          int32_t kernel_begin = group * STRIDED_KERNEL_GROUP;
+          int32_t kernel_end = kernel_begin + STRIDED_KERNEL_GROUP < num_kernels ? kernel_begin + STRIDED_KERNEL_GROUP
+                                                                                 : num_kernels;
+          int32_t first_entry = 0;
+          int32_t num_split = 0;
+
+          for (int32_t m = 0; m < kernel_begin; m++)
+            first_entry += num_entries[m];
+          if (stride_cols > 1)
+            memset(split, -1, sizeof(int32_t) * window_rows);
+
+          for (int32_t i = row_begin; i < row_end; i++)
+          {
+            for (int32_t slot = 0; slot < num_slots; slot++)
+            {
+              int32_t window_row = (i - row_begin) * stride_rows + slot_rows[slot];
+              const int32_t *a_row =
+                  &args->a[((size_t)row_begin * stride_rows + window_row) * args->cols_a + first_col];
+
+              // Without a column stride the entries read A in place
+              if (stride_cols > 1 && split[window_row] < 0)
+              {
+                split[window_row] = num_split++;
+                split_planes(a_row, args->cols_a - first_col, stride_cols, &planes[split[window_row] * split_size],
+                             plane_cols, plane_cols);
+              }
+              rows[slot] = stride_cols > 1 ? &planes[split[window_row] * split_size] : a_row;
+            }
+
+            for (int32_t m = kernel_begin, e = first_entry; m < kernel_end; m++)
+            {
+              for (int32_t n = 0; n < num_entries[m]; n++, e++)
+              {
+                int32_t col = entries[e].col;
+
+                sources[n] = stride_cols > 1 ? rows[slots[e]] + col % stride_cols * plane_cols + col / stride_cols
+                                             : rows[slots[e]] + col;
+              }
+
+              weighted_sum(&args->output[m * output_size + (size_t)i * args->cols_output + col_begin], sources,
+                           &values[e - num_entries[m]], num_entries[m], cols);
+            }
+          }
+        }
+      }
+    }
+
+    free(planes);
+    free(split);
+    free(rows);
+    free(sources);
+  }
+
+  free(values);
+  free(slots);
+  free(slot_rows);
+}
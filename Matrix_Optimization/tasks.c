@@ -0,0 +1,258 @@
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "matrix_file.h"
+#include "options.h"
+#include "tasks.h"
+
+// Name of the optional file in a task's directory that holds its convolution params
+#define PARAMS_FILE "params"
+
+// Largest number of tasks run as one batch; more kernels per pass over A also means fewer, larger
+// units of work to balance across workers
+#define DEFAULT_BATCH_SIZE 16
+
+typedef struct
+{
+  char *a_path;
+  int index;
+} task_key_t;
+
+// A run of sorted keys that forms one group
+typedef struct
+{
+  int start;
+  int num_tasks;
+  int first_index;
+} key_run_t;
+
+static int compare_keys(const void *a, const void *b)
+{
+  const task_key_t *key_a = a, *key_b = b;
+  int order = strcmp(key_a->a_path, key_b->a_path);
+
+  return order != 0 ? order : key_a->index - key_b->index;
+}
+
+// Orders runs by the list position of their first task
+static int compare_runs(const void *a, const void *b)
+{
+  const key_run_t *run_a = a, *run_b = b;
+
+  return run_a->first_index - run_b->first_index;
+}
+
+int group_tasks(int num_tasks, task_t **tasks, int *num_groups, task_group_t **groups)
+{
+  int batch_size = get_option_long("batch-size", DEFAULT_BATCH_SIZE);
+  task_key_t *keys = malloc(sizeof(task_key_t) * (num_tasks > 0 ? num_tasks : 1));
+  key_run_t *runs = malloc(sizeof(key_run_t) * (num_tasks > 0 ? num_tasks : 1));
+  int num_runs = 0;
+
+  if (batch_size < 1)
+    batch_size = 1;
+
+  for (int i = 0; i < num_tasks; i++)
+  {
+    keys[i].a_path = get_a_matrix_path(tasks[i]);
+    keys[i].index = i;
+  }
+  qsort(keys, num_tasks, sizeof(task_key_t), compare_keys);
+
+  for (int i = 0; i < num_tasks; i++)
+  {
+    bool same_a = i > 0 && strcmp(keys[i].a_path, keys[i - 1].a_path) == 0;
+
+    if (!same_a || runs[num_runs - 1].num_tasks == batch_size)
+    {
+      runs[num_runs].start = i;
+      runs[num_runs].num_tasks = 0;
+      runs[num_runs].first_index = keys[i].index;
+      num_runs++;
+    }
+    runs[num_runs - 1].num_tasks++;
+  }
+
+  // Keep groups in list order so runs stay reproducible and close to the original schedule
+  qsort(runs, num_runs, sizeof(key_run_t), compare_runs);
+
+  *num_groups = num_runs;
+  *groups = malloc(sizeof(task_group_t) * (num_runs > 0 ? num_runs : 1));
+  for (int g = 0; g < num_runs; g++)
+  {
+    (*groups)[g].num_tasks = runs[g].num_tasks;
+    (*groups)[g].tasks = malloc(sizeof(task_t *) * runs[g].num_tasks);
+
+    for (int t = 0; t < runs[g].num_tasks; t++)
+      (*groups)[g].tasks[t] = tasks[keys[runs[g].start + t].index];
+  }
+
+  for (int i = 0; i < num_tasks; i++)
+    free(keys[i].a_path);
+  free(keys);
+  free(runs);
+  return 0;
+}
+
+void free_task_groups(int num_groups, task_group_t *groups)
+{
+  for (int g = 0; g < num_groups; g++)
+    free(groups[g].tasks);
+  free(groups);
+}
+
+// Parses `n` (both dimensions) or `rows,cols`, followed by nothing but whitespace; every value must
+// be positive
+static bool parse_pair(const char *value, int32_t *rows, int32_t *cols)
+{
+  char *end;
+  long first = strtol(value, &end, 10);
+  long second = first;
+
+  if (*end == ',')
+    second = strtol(end + 1, &end, 10);
+  end += strspn(end, " \t\r\n");
+
+  if (*end != '\0' || first < 1 || second < 1 || first > INT32_MAX || second > INT32_MAX)
+    return false;
+
+  *rows = first;
+  *cols = second;
+  return true;
+}
+
+// Parses a single positive count, followed by nothing but whitespace
+static bool parse_count(const char *value, int32_t *count)
+{
+  int32_t second;
+
+  return strchr(value, ',') == NULL && parse_pair(value, count, &second);
+}
+
+int read_task_params(task_t *task, conv_params_t *params)
+{
+  char *path = malloc(strlen(task->path) + sizeof(PARAMS_FILE) + 1);
+  char line[256];
+  int line_number = 0;
+  int result = 0;
+
+  *params = (conv_params_t){1, 1, 1, 1, 1, 1};
+  sprintf(path, "%s/%s", task->path, PARAMS_FILE);
+
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    free(path);
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+  {
+    char *name = line + strspn(line, " \t\r\n");
+    char *value = strchr(name, '=');
+
+    line_number++;
+    if (*name == '\0' || *name == '#')
+      continue;
+
+    if (value != NULL)
+      *value++ = '\0';
+    if (value != NULL && strcmp(name, "stride") == 0 &&
+        parse_pair(value, &params->stride_rows, &params->stride_cols))
+      continue;
+    if (value != NULL && strcmp(name, "dilation") == 0 &&
+        parse_pair(value, &params->dilation_rows, &params->dilation_cols))
+      continue;
+    if (value != NULL && strcmp(name, "channels") == 0 && parse_count(value, &params->channels))
+      continue;
+    if (value != NULL && strcmp(name, "filters") == 0 && parse_count(value, &params->filters))
+      continue;
+
+    fprintf(stderr, "Error: cannot parse line %d of %s\n", line_number, path);
+    result = -1;
+  }
+
+  fclose(file);
+  free(path);
+  return result;
+}
+
+bool dense_params(const conv_params_t *params)
+{
+  return params->stride_rows == 1 && params->stride_cols == 1 && params->dilation_rows == 1 &&
+         params->dilation_cols == 1 && params->channels == 1 && params->filters == 1;
+}
+
+bool params_output_size(const conv_params_t *params, int32_t rows_a, int32_t cols_a, int32_t rows_b, int32_t cols_b,
+                        int32_t *rows_output, int32_t *cols_output)
+{
+  int64_t kernels = (int64_t)params->channels * params->filters;
+
+  if (rows_a % params->channels != 0 || rows_b % kernels != 0)
+    return false;
+
+  // Rows of one channel of A, and rows and columns of it covered by one dilated kernel
+  int32_t rows_channel = rows_a / params->channels;
+  int64_t rows_span = (int64_t)(rows_b / kernels - 1) * params->dilation_rows + 1;
+  int64_t cols_span = (int64_t)(cols_b - 1) * params->dilation_cols + 1;
+
+  if (rows_b < 1 || cols_b < 1 || rows_span > rows_channel || cols_span > cols_a)
+    return false;
+
+  // One block of rows per filter
+  int64_t rows = params->filters * ((rows_channel - rows_span) / params->stride_rows + 1);
+  if (rows > INT32_MAX)
+    return false;
+
+  *rows_output = rows;
+  *cols_output = (cols_a - cols_span) / params->stride_cols + 1;
+  return true;
+}
+
+// Returns the number of int32 elements in a legacy matrix file, from its size
+static int64_t legacy_elements(char *path)
+{
+  struct stat st;
+
+  return stat(path, &st) == 0 ? st.st_size / (int64_t)sizeof(int32_t) : 0;
+}
+
+int64_t task_work(task_t *task, bool *exact)
+{
+  char *a_path = get_a_matrix_path(task);
+  char *b_path = get_b_matrix_path(task);
+  matrix_header_t a_header, b_header;
+  int a_fd = open_matrix_stream(a_path, &a_header);
+  int b_fd = open_matrix_stream(b_path, &b_header);
+  int64_t work = 0;
+  int32_t rows_output, cols_output;
+  conv_params_t params;
+
+  // Malformed params fail the task when it runs; until then it is sized as a dense one
+  if (read_task_params(task, &params))
+    params = (conv_params_t){1, 1, 1, 1, 1, 1};
+
+  *exact = a_fd >= 0 && b_fd >= 0;
+  if (*exact && params_output_size(&params, a_header.rows, a_header.cols, b_header.rows, b_header.cols,
+                                    &rows_output, &cols_output))
+  {
+    // Each output sums one kernel per channel, a filter's share of B
+    work = (int64_t)rows_output * cols_output * (b_header.rows / params.filters) * b_header.cols;
+  }
+  else if (!*exact)
+  {
+    // Legacy files only give their element counts; A's size times B's bounds the work from above,
+    // a stride keeps only a share of the outputs, and each channel of A only meets its own kernels
+    work = legacy_elements(a_path) * legacy_elements(b_path) / params.stride_rows / params.stride_cols /
+           params.channels;
+  }
+
+  if (a_fd >= 0)
+    close(a_fd);
+  if (b_fd >= 0)
+    close(b_fd);
+  free(a_path);
+  free(b_path);
+  return work;
+}
@@ -0,0 +1,79 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compute.h"
+
+// Tasks that read the same A matrix, run together by execute_task_batch()
+typedef struct
+{
+  int num_tasks;
+  task_t **tasks;
+} task_group_t;
+
+// Groups tasks by the path of their A matrix, keeping groups in order of their first task and tasks
+// in list order; groups are capped at the `batch-size` option
+int group_tasks(int num_tasks, task_t **tasks, int *num_groups, task_group_t **groups);
+
+// Frees the groups from group_tasks() (but not the tasks)
+void free_task_groups(int num_groups, task_group_t *groups);
+
+// Returns the multiply-adds a task takes, honoring its params. The count is exact, and `exact` is
+// set, when both inputs are in the mapped format; otherwise it is estimated from the file sizes.
+int64_t task_work(task_t *task, bool *exact);
+
+// Shape of a task, from the optional `params` file in its directory. The file holds `name=value`
+// lines; blank lines and lines starting with `#` are ignored.
+//
+// `stride` and `dilation` take one value for both dimensions or `rows,cols`. Output (i, j) is the
+// sum over kernel positions (k, c) of a[i * stride_rows + k * dilation_rows][j * stride_cols + c *
+// dilation_cols] times flipped_b[k][c].
+//
+// `channels=C` and `filters=M` make it a multi-channel task: A holds a C x H x W tensor as C
+// matrices of H rows stacked on top of each other, B holds an M x C x Kh x Kw filter bank the same
+// way (the kernel of filter m and channel c starts at row (m * C + c) * Kh), and output channel m,
+// at rows m * Ho to (m + 1) * Ho of the output, is the sum over the channels of A's channel c
+// convolved with the kernel of filter m and channel c.
+//
+// Every value defaults to 1, the dense convolution of one A and one B.
+typedef struct
+{
+  int32_t stride_rows;
+  int32_t stride_cols;
+  int32_t dilation_rows;
+  int32_t dilation_cols;
+  int32_t channels;
+  int32_t filters;
+} conv_params_t;
+
+// Reads the params of a task, or the defaults if it has no params file; returns -1 if the file
+// cannot be parsed
+int read_task_params(task_t *task, conv_params_t *params);
+
+// Returns true if params describe the dense convolution of one A and one B
+bool dense_params(const conv_params_t *params);
+
+// Computes the output size of a convolution with params; returns false if A and B do not divide
+// into the channels and filters, or the dilated kernel does not fit in a channel of A
+bool params_output_size(const conv_params_t *params, int32_t rows_a, int32_t cols_a, int32_t rows_b, int32_t cols_b,
+                        int32_t *rows_output, int32_t *cols_output);
+
+// Computes a convolution with params: strided, dilated and/or multi-channel, computing only the
+// outputs the stride keeps (naive.c, optimized.c)
+int convolve_params(matrix_t *a_matrix, matrix_t *b_matrix, const conv_params_t *params, matrix_t **output_matrix);
+
+// Executes tasks that all share one A matrix, reading A once (naive.c, optimized.c)
+int execute_task_batch(task_t **tasks, int num_tasks);
+
+// Executes groups one after another with their I/O overlapped: a background thread loads the next
+// group's inputs and writes the previous group's outputs while the current group computes. On
+// failure returns -1 and sets `failed` to the first task that failed (naive.c, optimized.c).
+int execute_task_groups(task_group_t **groups, int num_groups, task_t **failed);
+
+// Executes part `band` of `num_bands` of one task, each part computing an equal share of the output
+// rows and writing them in place; together the parts produce the whole output (naive.c, optimized.c)
+int execute_task_band(task_t *task, int band, int num_bands);
+
+#endif
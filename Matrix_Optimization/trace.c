@@ -0,0 +1,167 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "options.h"
+#include "trace.h"
+
+typedef struct
+{
+  const char *phase;
+  char *task;
+  int64_t begin;
+  int64_t end;
+  int thread;
+} trace_event_t;
+
+bool trace_enabled;
+
+static int trace_rank;
+static trace_event_t *events;
+static int num_events;
+static int capacity;
+static int num_threads;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Small per-process thread numbers, assigned as threads record their first event
+static __thread int thread_number = -1;
+
+void trace_start(int rank)
+{
+  trace_rank = rank;
+  trace_enabled = get_option("trace") != NULL;
+}
+
+int64_t trace_clock()
+{
+  struct timespec now;
+
+  // CLOCK_MONOTONIC is shared by every process on a node, so their traces line up
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_record(const char *phase, const char *task, int64_t begin)
+{
+  int64_t end = trace_clock();
+  char *task_copy = task != NULL ? strdup(task) : NULL;
+
+  pthread_mutex_lock(&trace_lock);
+  if (thread_number < 0)
+    thread_number = num_threads++;
+
+  if (num_events == capacity)
+  {
+    capacity = capacity > 0 ? capacity * 2 : 1024;
+    events = realloc(events, sizeof(trace_event_t) * capacity);
+  }
+  events[num_events++] = (trace_event_t){phase, task_copy, begin, end, thread_number};
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// Writes a string as a JSON string literal
+static void write_string(FILE *file, const char *string)
+{
+  fputc('"', file);
+  for (const char *c = string; *c != '\0'; c++)
+  {
+    if (*c == '"' || *c == '\\')
+      fprintf(file, "\\%c", *c);
+    else if ((unsigned char)*c < 0x20)
+      fprintf(file, "\\u%04x", *c);
+    else
+      fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
+// Writes the total and longest time spent in each phase. Phases nest (a task contains its reads),
+// so the totals of different phases overlap.
+static void write_summary(FILE *file)
+{
+  const char **phases = malloc(sizeof(char *) * (num_events > 0 ? num_events : 1));
+  int num_phases = 0;
+
+  for (int e = 0; e < num_events; e++)
+  {
+    int p = 0;
+    while (p < num_phases && strcmp(phases[p], events[e].phase) != 0)
+      p++;
+    if (p == num_phases)
+      phases[num_phases++] = events[e].phase;
+  }
+
+  fprintf(file, "\"summary\": {\"rank\": %d, \"phases\": {", trace_rank);
+  for (int p = 0; p < num_phases; p++)
+  {
+    int count = 0;
+    int64_t total = 0, longest = 0;
+
+    for (int e = 0; e < num_events; e++)
+    {
+      if (strcmp(events[e].phase, phases[p]) != 0)
+        continue;
+
+      int64_t duration = events[e].end - events[e].begin;
+      count++;
+      total += duration;
+      longest = duration > longest ? duration : longest;
+    }
+
+    fprintf(file, "%s\n  \"%s\": {\"count\": %d, \"seconds\": %.6f, \"max_seconds\": %.6f}", p > 0 ? "," : "",
+            phases[p], count, total / 1e9, longest / 1e9);
+  }
+  fprintf(file, "\n}}");
+
+  free(phases);
+}
+
+void trace_stop()
+{
+  const char *path = get_option("trace");
+  if (!trace_enabled || path == NULL)
+    return;
+
+  trace_enabled = false;
+
+  char *file_path = malloc(strlen(path) + 32);
+  sprintf(file_path, "%s.%d.json", path, trace_rank);
+  FILE *file = fopen(file_path, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Warning: could not write trace %s\n", file_path);
+    free(file_path);
+    return;
+  }
+
+  // Complete ("X") events in microseconds, one process per rank and one thread per thread
+  fprintf(file, "{\"traceEvents\": [\n");
+  fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"rank %d\"}}",
+          trace_rank, trace_rank);
+  for (int e = 0; e < num_events; e++)
+  {
+    fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+            events[e].phase, events[e].begin / 1e3, (events[e].end - events[e].begin) / 1e3, trace_rank,
+            events[e].thread);
+    if (events[e].task != NULL)
+    {
+      fprintf(file, ", \"args\": {\"task\": ");
+      write_string(file, events[e].task);
+      fprintf(file, "}");
+    }
+    fprintf(file, "}");
+  }
+  fprintf(file, "\n],\n");
+  write_summary(file);
+  fprintf(file, "}\n");
+  fclose(file);
+
+  for (int e = 0; e < num_events; e++)
+    free(events[e].task);
+  free(events);
+  free(file_path);
+  events = NULL;
+  num_events = capacity = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timing of the phases of each task (reading inputs, planning the kernel, convolving, writing the
+// output, waiting on I/O or MPI), written as a Chrome trace that chrome://tracing and Perfetto
+// open. Tracing is on when the `trace` option names an output file; each process writes
+// `<trace>.<rank>.json`, with one event per phase and a per-phase summary. When it is off, a
+// trace_begin()/trace_end() pair costs two predictable branches.
+
+extern bool trace_enabled;
+
+// Starts tracing for this process if the `trace` option is set
+void trace_start(int rank);
+
+// Writes the trace, if tracing was started
+void trace_stop();
+
+// Returns the current time in nanoseconds
+int64_t trace_clock();
+
+// Records that `phase` ran from `begin` until now on this thread, for `task` (which may be NULL).
+// `phase` must be a string literal; `task` is copied.
+void trace_record(const char *phase, const char *task, int64_t begin);
+
+static inline int64_t trace_begin()
+{
+  return trace_enabled ? trace_clock() : 0;
+}
+
+static inline void trace_end(const char *phase, const char *task, int64_t begin)
+{
+  if (trace_enabled)
+    trace_record(phase, task, begin);
+}
+
+#endif